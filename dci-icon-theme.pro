@@ -1,6 +1,7 @@
-QT += dtkcore
+QT += dtkcore concurrent svg
+PKGCONFIG += libwebp
 
-CONFIG += c++17 console
+CONFIG += c++17 console link_pkgconfig
 CONFIG -= app_bundle
 
 # You can make your code fail to compile if it uses deprecated APIs.
@@ -2,174 +2,3395 @@
 //
 // SPDX-License-Identifier: LGPL-3.0-or-later
 
+#include <QCoreApplication>
 #include <QGuiApplication>
 #include <QImageReader>
+#include <QBuffer>
 #include <QCommandLineParser>
+#include <QDir>
 #include <QDirIterator>
-#include <QBuffer>
+#include <QRegExp>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QtMath>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QPainter>
+#include <QSvgRenderer>
+#include <QThread>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QTimer>
+#include <QFileSystemWatcher>
+#include <QtConcurrent>
+#include <QtEndian>
 #include <QDebug>
 
 #include <DDciFile>
 
+#include <webp/encode.h>
+#include <webp/decode.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
 DCORE_USE_NAMESPACE
 
+// The --keep-going mode records the failure of the current icon instead of exiting,
+// the stages reset it before an icon and check it after the icon.
+static bool keepGoing = false;
+static thread_local bool dciFailed = false;
+// The process can't exit while the stages run in the worker threads, dciChecker records
+// the failure instead, the stages stop taking the next icons, and the main thread exits
+// after the workers are joined.
+static QAtomicInt workersRunning;
+static QAtomicInt dciFatal;
+
 static inline void dciChecker(bool result) {
     if (!result) {
         qWarning() << "Failed on writing dci file";
+        dciFailed = true;
+        if (keepGoing)
+            return;
+        if (!workersRunning.loadAcquire())
+            exit(-6);
+        dciFatal.storeRelease(1);
+    }
+}
+
+static void beginWorkers()
+{
+    workersRunning.storeRelease(1);
+}
+
+// Called by the main thread after the workers are joined
+static void endWorkers()
+{
+    workersRunning.storeRelease(0);
+    if (dciFatal.loadAcquire())
         exit(-6);
+}
+
+// The outputs are written to a temporary file at first, and renamed to the target
+// when it's complete, so a failed or interrupted build never leaves a broken file.
+static QString temporaryFilePath(const QString &fileName)
+{
+    return fileName + ".tmp";
+}
+
+static bool commitTemporaryFile(const QString &fileName)
+{
+    // The rename replaces the old file (or the symlink of --dedup) atomically
+    return ::rename(QFile::encodeName(temporaryFilePath(fileName)).constData(),
+                    QFile::encodeName(fileName).constData()) == 0;
+}
+
+struct WebPOptions {
+    int quality = 100;
+    // The quality 100 also means lossless, the same as the webp plugin of Qt
+    bool lossless = false;
+    // 0 is the fastest, 6 is the slowest and gives the smallest files
+    int method = 4;
+    // The preprocessing of the lossless encoding, 100 means off
+    int nearLossless = 100;
+};
+
+// The buffers of the decode, scale and encode stages of a worker thread, they're
+// reused by the next images, so the hot path doesn't allocate them for every icon.
+struct ImageBuffers {
+    QImage decoded;
+    QImage rendered; // the SVG image of a pixel size
+    QImage scaled;
+    QImage argb; // the unpremultiplied pixels given to libwebp
+    QVector<quint32> sums; // the sums of a row of boxDownscaled
+    QByteArray encoded;
+};
+static thread_local ImageBuffers imageBuffers;
+
+// Return the buffer if it has the size and format, or else allocate it again. The
+// buffer is written without a copy if the image given to the previous user is released.
+static QImage &reuseImage(QImage &buffer, int width, int height, QImage::Format format)
+{
+    if (buffer.width() != width || buffer.height() != height || buffer.format() != format)
+        buffer = QImage(width, height, format);
+    return buffer;
+}
+
+static int appendWebPData(const uint8_t *data, size_t size, const WebPPicture *picture)
+{
+    static_cast<QByteArray *>(picture->custom_ptr)->append(reinterpret_cast<const char *>(data),
+                                                           static_cast<int>(size));
+    return 1;
+}
+
+// Call libwebp directly, the webp plugin of Qt can't pass the encoder method
+static inline QByteArray webpImageData(const QImage &image, const WebPOptions &options) {
+    WebPConfig config;
+    dciChecker(WebPConfigInit(&config));
+    config.quality = options.quality;
+    config.lossless = options.lossless || options.quality >= 100;
+    config.method = options.method;
+    config.near_lossless = options.nearLossless;
+    dciChecker(WebPValidateConfig(&config));
+
+    // The argb pixels of libwebp are same as QImage::Format_ARGB32, so give it the
+    // reused buffer instead of the copy of WebPPictureImportRGBA. The encoder may
+    // change the transparent pixels, so never give it the pixels of the image.
+    const QImage source = image.format() == QImage::Format_ARGB32
+            || image.format() == QImage::Format_ARGB32_Premultiplied
+            ? image : image.convertToFormat(QImage::Format_ARGB32);
+    const bool premultiplied = source.format() == QImage::Format_ARGB32_Premultiplied;
+    QImage &argb = reuseImage(imageBuffers.argb, source.width(), source.height(), QImage::Format_ARGB32);
+    for (int y = 0; y < source.height(); ++y) {
+        const QRgb *from = reinterpret_cast<const QRgb *>(source.constScanLine(y));
+        QRgb *to = reinterpret_cast<QRgb *>(argb.scanLine(y));
+        if (premultiplied) {
+            for (int x = 0; x < source.width(); ++x)
+                to[x] = qUnpremultiply(from[x]);
+        } else {
+            memcpy(to, from, static_cast<size_t>(source.width()) * sizeof(QRgb));
+        }
+    }
+
+    WebPPicture picture;
+    dciChecker(WebPPictureInit(&picture));
+    picture.use_argb = 1;
+    picture.width = argb.width();
+    picture.height = argb.height();
+    picture.argb = reinterpret_cast<uint32_t *>(argb.bits());
+    picture.argb_stride = argb.bytesPerLine() / 4;
+
+    // Keep the capacity of the buffer for the next images
+    QByteArray &encoded = imageBuffers.encoded;
+    if (encoded.capacity() < argb.width() * argb.height())
+        encoded.reserve(argb.width() * argb.height());
+    encoded.resize(0);
+    picture.writer = appendWebPData;
+    picture.custom_ptr = &encoded;
+
+    // The picture doesn't own the argb pixels, it only frees the buffers of the encoder
+    const bool ok = WebPEncode(&config, &picture);
+    WebPPictureFree(&picture);
+    dciChecker(ok);
+
+    return QByteArray(encoded.constData(), encoded.size());
+}
+
+static bool readFileData(const QString &fileName, QByteArray &data)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed on read the image file:" << fileName << file.errorString();
+        return false;
+    }
+
+    data = file.readAll();
+    return true;
+}
+
+// Decode the image data of the "imageFile", the suffix of the file name is used as the format hint.
+// The image is decoded to the buffer of the worker thread, release it before the next call.
+static QImage readImage(const QByteArray &data, const QString &imageFile, int size)
+{
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader image(&buffer, QFileInfo(imageFile).suffix().toLatin1());
+    if (!image.canRead()) {
+        qWarning() << "Ignore the null image file:" << imageFile;
+        return QImage();
+    }
+
+    // Let the vector image formats render at the target size directly
+    if (image.supportsOption(QImageIOHandler::ScaledSize)) {
+        image.setScaledSize(QSize(size, size));
+    }
+
+    // The reader doesn't allocate the image again if it has the same size and format
+    if (!image.read(&imageBuffers.decoded)) {
+        qWarning() << "Ignore the null image file:" << imageFile << image.errorString();
+        return QImage();
+    }
+
+    return imageBuffers.decoded;
+}
+
+static bool isSvgFile(const QString &fileName)
+{
+    const QString suffix = QFileInfo(fileName).suffix().toLower();
+    return suffix == QLatin1String("svg") || suffix == QLatin1String("svgz");
+}
+
+// Render the SVG document to the image buffer of the pixel size, it's sharper than
+// to scale the image of the largest size.
+static QImage renderSvg(QSvgRenderer &renderer, int pixelSize)
+{
+    QImage &image = reuseImage(imageBuffers.rendered, pixelSize, pixelSize, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    {
+        QPainter painter(&image);
+        renderer.render(&painter);
+    }
+    return image;
+}
+
+// The pixel size of the image data from the header, it's not decoded
+static QSize imageHeaderSize(const QByteArray &data, const QByteArray &format)
+{
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer, format);
+    return reader.canRead() ? reader.size() : QSize();
+}
+
+// The pixel size of the source if it's a webp image, only the header is read
+static QSize webpSourceSize(const QByteArray &data)
+{
+    if (!data.startsWith("RIFF") || data.mid(8, 4) != "WEBP")
+        return QSize();
+
+    return imageHeaderSize(data, "webp");
+}
+
+// The encoded webp files shared by the builds, the file of a key is "<dir>/<key[0:2]>/<key[2:]>.webp",
+// the files are written by rename, so the directory can be shared by many processes, e.g. on NFS.
+class EncodeCache
+{
+public:
+    EncodeCache(const QString &path, qint64 maxSize)
+        : m_dir(path)
+        , m_maxSize(maxSize) {}
+
+    bool read(const QByteArray &key, QByteArray &data) {
+        const QString file = filePath(key);
+        QFile cacheFile(file);
+        if (!cacheFile.open(QIODevice::ReadOnly)) {
+            m_misses.ref();
+            return false;
+        }
+
+        data = cacheFile.readAll();
+        if (!data.startsWith("RIFF")) {
+            data.clear();
+            m_misses.ref();
+            return false;
+        }
+
+        // Update the mtime for the LRU of trim()
+        utimensat(AT_FDCWD, QFile::encodeName(file).constData(), nullptr, 0);
+        m_hits.ref();
+        return true;
+    }
+
+    void write(const QByteArray &key, const QByteArray &data) {
+        const QString file = filePath(key);
+        if (!QDir().mkpath(QFileInfo(file).path()))
+            return;
+
+        QSaveFile cacheFile(file);
+        if (cacheFile.open(QIODevice::WriteOnly)) {
+            cacheFile.write(data);
+            cacheFile.commit();
+        }
+    }
+
+    // Remove the least recently used files if the cache is larger than the max size
+    void trim() {
+        if (m_maxSize <= 0)
+            return;
+
+        QVector<QPair<qint64, QString>> files;
+        qint64 totalSize = 0;
+        QDirIterator di(m_dir, {"*.webp"}, QDir::Files, QDirIterator::Subdirectories);
+        while (di.hasNext()) {
+            di.next();
+            const QFileInfo &info = di.fileInfo();
+            files.append({info.lastModified().toMSecsSinceEpoch(), info.filePath()});
+            totalSize += info.size();
+        }
+
+        if (totalSize <= m_maxSize)
+            return;
+
+        std::sort(files.begin(), files.end());
+        for (const auto &i : qAsConst(files)) {
+            if (totalSize <= m_maxSize)
+                break;
+            const qint64 size = QFileInfo(i.second).size();
+            if (QFile::remove(i.second))
+                totalSize -= size;
+        }
+    }
+
+    int hits() const {
+        return m_hits.load();
+    }
+
+    int misses() const {
+        return m_misses.load();
+    }
+
+private:
+    QString filePath(const QByteArray &key) const {
+        return m_dir + "/" + QString::fromLatin1(key.left(2)) + "/" + QString::fromLatin1(key.mid(2)) + ".webp";
+    }
+
+    const QString m_dir;
+    const qint64 m_maxSize;
+    QAtomicInt m_hits;
+    QAtomicInt m_misses;
+};
+
+// The manifest entries of the icons are appended to the journal as they are written, so the next
+// build keeps the icons of an interrupted build, loadManifest merges it and saveManifest removes it.
+// The first line is { "settings" }, and each icon is a line of { "source", "entry" }.
+class ManifestJournal
+{
+public:
+    explicit ManifestJournal(const QString &fileName)
+        : m_file(fileName)
+    {
+    }
+
+    bool open(const QString &settings) {
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            return false;
+        return writeLine(QJsonObject {{"settings", settings}});
+    }
+
+    // Only the write stage of convertIcons appends the entries, so it's no need to lock
+    bool append(const QString &source, const QJsonObject &entry) {
+        return writeLine(QJsonObject {{"source", source}, {"entry", entry}});
+    }
+
+    void close() {
+        m_file.close();
+    }
+
+private:
+    bool writeLine(const QJsonObject &line) {
+        if (!m_file.isOpen())
+            return false;
+        m_file.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n');
+        return m_file.flush();
+    }
+
+    QFile m_file;
+};
+
+struct ConvertOptions {
+    QList<int> sizes { 256 };
+    QList<int> scales { 2, 3 };
+    WebPOptions webp;
+    bool dedup = false;
+    bool streamWriter = false;
+    bool merge = false;
+    // Choose the webp settings of every icon by the content of the image
+    bool autoEncode = false;
+    // The budget (in bytes) of the icons in the pipeline, 0 means no limit
+    qint64 maxMemory = 0;
+    EncodeCache *cache = nullptr;
+    ManifestJournal *journal = nullptr;
+
+    int maxImageSize() const {
+        return sizes.last() * scales.last();
+    }
+
+    // The settings of an encoded image, except the source and the pixel size
+    QByteArray encoderKey() const {
+        return QString("v1 %1 webp:%2:%3:%4%5").arg(maxImageSize()).arg(webp.quality)
+                .arg(webp.lossless).arg(webp.method).arg(autoEncode ? ":auto" : "").toLatin1();
+    }
+
+    // All of the settings that affect the content of the output files,
+    // the incremental mode rebuilds every icon when it's changed.
+    QString settingsKey() const {
+        QStringList list;
+        for (int size : sizes)
+            list << QString::number(size);
+        list << "@";
+        for (int scale : scales)
+            list << QString::number(scale);
+        list << QString("webp:%1:%2:%3").arg(webp.quality).arg(webp.lossless).arg(webp.method);
+        if (dedup)
+            list << "dedup";
+        if (merge)
+            list << "merge";
+        if (autoEncode)
+            list << "auto-encode";
+        return list.join(' ');
+    }
+};
+
+// The time (in nanoseconds) and bytes of the stages of an icon, each icon is
+// converted by only one worker, so it's no need to lock.
+struct IconStats {
+    qint64 decode = 0;
+    qint64 scale = 0;
+    qint64 encode = 0;
+    qint64 write = 0;
+    qint64 bytesIn = 0;
+    qint64 bytesOut = 0;
+    // The preset of --auto-encode of the light image, it's empty if all images are cached
+    const char *preset = nullptr;
+
+    qint64 total() const {
+        return decode + scale + encode + write;
+    }
+};
+
+// Average the factor x factor blocks of the premultiplied pixels, it's exact for the
+// integer downscale, and much cheaper than the smooth transformation of QImage.
+static QImage boxDownscaled(const QImage &image, int factor)
+{
+    // The decoded ARGB32 images are premultiplied while reading the pixels, it's no need to convert them
+    const bool premultiply = image.format() == QImage::Format_ARGB32;
+    const QImage source = premultiply || image.format() == QImage::Format_RGB32
+            ? image : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    const int width = source.width() / factor;
+    const int height = source.height() / factor;
+    const quint32 area = static_cast<quint32>(factor * factor);
+
+    QImage &target = reuseImage(imageBuffers.scaled, width, height, QImage::Format_ARGB32_Premultiplied);
+    QVector<quint32> &sums = imageBuffers.sums;
+    sums.resize(width * 4);
+    for (int y = 0; y < height; ++y) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int i = 0; i < factor; ++i) {
+            const QRgb *line = reinterpret_cast<const QRgb *>(source.constScanLine(y * factor + i));
+            quint32 *sum = sums.data();
+            for (int x = 0; x < width; ++x, sum += 4) {
+                for (int j = 0; j < factor; ++j) {
+                    const QRgb pixel = premultiply ? qPremultiply(*line++) : *line++;
+                    sum[0] += qAlpha(pixel);
+                    sum[1] += qRed(pixel);
+                    sum[2] += qGreen(pixel);
+                    sum[3] += qBlue(pixel);
+                }
+            }
+        }
+
+        QRgb *line = reinterpret_cast<QRgb *>(target.scanLine(y));
+        const quint32 *sum = sums.constData();
+        for (int x = 0; x < width; ++x, sum += 4) {
+            line[x] = qRgba(static_cast<int>((sum[1] + area / 2) / area),
+                            static_cast<int>((sum[2] + area / 2) / area),
+                            static_cast<int>((sum[3] + area / 2) / area),
+                            static_cast<int>((sum[0] + area / 2) / area));
+        }
+    }
+
+    return target;
+}
+
+static QImage scaledImage(const QImage &image, int width)
+{
+    // The image reader may have given the target size already
+    if (image.width() == width)
+        return image;
+
+    if (image.width() > width && image.width() % width == 0) {
+        const int factor = image.width() / width;
+        if (image.height() % factor == 0)
+            return boxDownscaled(image, factor);
+    }
+
+    return image.scaledToWidth(width, Qt::SmoothTransformation);
+}
+
+// The settings of --auto-encode
+struct EncodePreset {
+    const char *name;
+    bool lossless;
+    int quality; // the compression effort of the lossless encoding
+    int nearLossless;
+};
+static const EncodePreset losslessPreset { "lossless", true, 75, 100 };
+static const EncodePreset nearLosslessPreset { "near-lossless", true, 75, 60 };
+static const EncodePreset lossyPreset { "lossy", false, 90, 100 };
+
+// Choose the preset by one pass over the pixels: the flat icons of a few colors (e.g. the
+// symbolic icons) are smaller and faster by the lossless encoding, the icons of many sharp
+// edges or translucent pixels keep them by the near-lossless encoding, and the photo-like
+// icons of the smooth colors use the lossy encoding.
+static const EncodePreset &autoEncodePreset(const QImage &image)
+{
+    static const int maxColors = 256;
+    static const int tableSize = 1024;
+    const QImage source = image.format() == QImage::Format_ARGB32
+            || image.format() == QImage::Format_ARGB32_Premultiplied || image.format() == QImage::Format_RGB32
+            ? image : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    // Count the colors by a small open addressing table until it's more than maxColors,
+    // the table never has an empty slot of the color 0, it's counted by "hasZero".
+    quint32 table[tableSize] = {};
+    int colors = 0;
+    bool hasZero = false;
+    qint64 translucent = 0, edges = 0;
+    for (int y = 0; y < source.height(); ++y) {
+        const QRgb *line = reinterpret_cast<const QRgb *>(source.constScanLine(y));
+        for (int x = 0; x < source.width(); ++x) {
+            const QRgb pixel = line[x];
+            const int alpha = qAlpha(pixel);
+            translucent += alpha > 0 && alpha < 255;
+            if (x > 0) {
+                const QRgb left = line[x - 1];
+                edges += qAbs(qGray(pixel) - qGray(left)) > 48 || qAbs(alpha - qAlpha(left)) > 48;
+            }
+
+            if (colors > maxColors)
+                continue;
+            if (pixel == 0) {
+                colors += !hasZero;
+                hasZero = true;
+                continue;
+            }
+            quint32 slot = (pixel * 2654435761u) >> 22;
+            while (table[slot] && table[slot] != pixel)
+                slot = (slot + 1) & (tableSize - 1);
+            if (!table[slot]) {
+                table[slot] = pixel;
+                ++colors;
+            }
+        }
+    }
+
+    const qint64 pixels = qMax<qint64>(1, qint64(source.width()) * source.height());
+    if (colors <= maxColors)
+        return losslessPreset;
+    if (edges * 10 > pixels || translucent * 5 > pixels)
+        return nearLosslessPreset;
+    return lossyPreset;
+}
+
+// The encoded files of an icon, the path in the dci file -> the file data
+typedef QVector<QPair<QString, QByteArray>> EncodedFiles;
+
+static QByteArray encodeScaledImage(const QImage &image, int size, int scale/* = 2*/,
+                                    const ConvertOptions &options, IconStats &stats)
+{
+    const int pixelSize = scale * size;
+
+    QElapsedTimer timer;
+    timer.start();
+    const QImage &img = scaledImage(image, pixelSize);
+    stats.scale += timer.nsecsElapsed();
+
+    timer.start();
+    const QByteArray &data = webpImageData(img, options.webp);
+    stats.encode += timer.nsecsElapsed();
+
+    return data;
+}
+
+// Encode the source at the pixel sizes (size * scale) of the options, only the given
+// pixel sizes are encoded if the "pixelSizes" is not empty.
+static bool encodeImage(const QByteArray &source, const QString &imageFile, const QString &mode,
+                        const ConvertOptions &options, IconStats &stats, EncodedFiles &files,
+                        const QList<int> &pixelSizes = QList<int>())
+{
+    auto filePath = [&mode](int size, int scale) {
+        return QString("/%1/%2/%3/1.webp").arg(size).arg(mode).arg(scale);
+    };
+    auto isWanted = [&pixelSizes](int pixelSize) {
+        return pixelSizes.isEmpty() || pixelSizes.contains(pixelSize);
+    };
+
+    // The cache key of an image is the hash of the source, the encoder settings and the pixel size
+    QVector<QByteArray> cacheKeys;
+    QVector<QByteArray> cachedData;
+    if (options.cache) {
+        const QByteArray sourceHash = QCryptographicHash::hash(source, QCryptographicHash::Sha1).toHex();
+        bool allCached = true;
+        for (int size : options.sizes) {
+            for (int scale : options.scales) {
+                const QByteArray key = QCryptographicHash::hash(sourceHash + ' ' + options.encoderKey() + ' '
+                                                                + QByteArray::number(size * scale),
+                                                                QCryptographicHash::Sha1).toHex();
+                QByteArray data;
+                if (isWanted(size * scale))
+                    allCached = options.cache->read(key, data) && allCached;
+                cacheKeys << key;
+                cachedData << data;
+            }
+        }
+
+        if (allCached) {
+            int i = 0;
+            for (int size : options.sizes) {
+                for (int scale : options.scales) {
+                    if (isWanted(size * scale))
+                        files.append({filePath(size, scale), cachedData.at(i)});
+                    ++i;
+                }
+            }
+            stats.bytesIn += source.size();
+            return true;
+        }
+    }
+
+    // A webp source of the pixel size is copied as it is, it's no need to decode and encode again
+    const QSize webpSize = webpSourceSize(source);
+    auto isSourceSize = [&webpSize](int pixelSize) {
+        return webpSize == QSize(pixelSize, pixelSize);
+    };
+
+    bool needDecode = false;
+    int i = 0;
+    for (int size : options.sizes) {
+        for (int scale : options.scales) {
+            if (isWanted(size * scale) && !isSourceSize(size * scale)
+                    && (!options.cache || cachedData.at(i).isEmpty())) {
+                needDecode = true;
+            }
+            ++i;
+        }
+    }
+
+    // Decode the source only once at the largest size, all of the other sizes and
+    // scales are derived from this image. The SVG document is parsed only once too,
+    // but it's rendered at every pixel size directly.
+    QImage image;
+    QScopedPointer<QSvgRenderer> svg;
+    QElapsedTimer timer;
+    ConvertOptions imageOptions = options;
+    const EncodePreset *preset = nullptr;
+    if (needDecode) {
+        timer.start();
+        if (isSvgFile(imageFile)) {
+            svg.reset(new QSvgRenderer(source));
+            if (!svg->isValid()) {
+                qWarning() << "Ignore the invalid svg file:" << imageFile;
+                return false;
+            }
+        } else {
+            image = readImage(source, imageFile, options.maxImageSize());
+            if (image.isNull())
+                return false;
+        }
+        stats.decode += timer.nsecsElapsed();
+    }
+    stats.bytesIn += source.size();
+
+    i = 0;
+    for (int size : options.sizes) {
+        for (int scale : options.scales) {
+            if (!isWanted(size * scale)) {
+                ++i;
+                continue;
+            }
+
+            QByteArray data;
+            if (isSourceSize(size * scale))
+                data = source;
+            else if (options.cache)
+                data = cachedData.at(i);
+            if (data.isEmpty()) {
+                if (svg) {
+                    timer.start();
+                    // Release the image of the former pixel size, so its buffer is rendered without a copy
+                    image = QImage();
+                    image = renderSvg(*svg, size * scale);
+                    stats.decode += timer.nsecsElapsed();
+                }
+
+                // The preset of the image is chosen by the first encoded pixel size
+                if (options.autoEncode && !preset) {
+                    preset = &autoEncodePreset(image);
+                    imageOptions.webp.lossless = preset->lossless;
+                    imageOptions.webp.quality = preset->quality;
+                    imageOptions.webp.nearLossless = preset->nearLossless;
+                    if (!stats.preset)
+                        stats.preset = preset->name;
+                }
+                data = encodeScaledImage(image, size, scale, imageOptions, stats);
+                if (options.cache)
+                    options.cache->write(cacheKeys.at(i), data);
+            }
+            files.append({filePath(size, scale), data});
+            ++i;
+        }
+    }
+
+    return true;
+}
+
+static void writeEncodedFiles(DDciFile &dci, const EncodedFiles &files)
+{
+    for (const auto &i : files) {
+        const QString dir = i.first.left(i.first.lastIndexOf('/'));
+        if (!dci.exists(dir))
+            dciChecker(dci.mkdir(dir));
+        dciChecker(dci.writeFile(i.first, i.second));
+    }
+}
+
+static bool recursionLink(DDciFile &dci, const QString &fromDir, const QString &targetDir)
+{
+    for (const auto &i : dci.list(fromDir, true)) {
+        const QString file(fromDir + "/" + i);
+        const QString targetFile(targetDir + "/" + i);
+        if (dci.type(file) == DDciFile::Directory) {
+            if (!dci.mkdir(targetFile))
+                return false;
+            if (!recursionLink(dci, file, targetFile))
+                return false;
+        } else {
+            if (!dci.link(file, targetFile))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// icon name -> symlink names, the names of an icon keep the insertion order,
+// and the duplicate check doesn't need to copy the names to a list.
+struct SymlinkMap {
+    bool insert(const QString &icon, const QString &name) {
+        auto &entry = aliases[icon];
+        if (entry.second.contains(name))
+            return false;
+
+        entry.first.append(name);
+        entry.second.insert(name);
+        ++count;
+        return true;
+    }
+
+    const QStringList &names(const QString &icon) const {
+        static const QStringList empty;
+        const auto it = aliases.constFind(icon);
+        return it == aliases.constEnd() ? empty : it->first;
+    }
+
+    int size() const {
+        return count;
+    }
+
+    QHash<QString, QPair<QStringList, QSet<QString>>> aliases;
+    int count = 0;
+};
+
+static inline bool isCsvSpace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+static inline void trimRange(const char *&begin, const char *&end) {
+    while (begin < end && isCsvSpace(*begin))
+        ++begin;
+    while (end > begin && isCsvSpace(*(end - 1)))
+        --end;
+}
+
+// Parse a RFC 4180 field starting at "pos", the field is returned as a range of
+// the csv data, only the quoted field with the escaped ["] is copied to "buffer".
+static void readCsvField(const char *&pos, const char *end, const char *&fieldBegin,
+                         const char *&fieldEnd, QByteArray &buffer)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+        ++pos;
+
+    if (pos == end || *pos != '"') {
+        fieldBegin = pos;
+        while (pos < end && *pos != ',' && *pos != '\n')
+            ++pos;
+        fieldEnd = pos;
+        trimRange(fieldBegin, fieldEnd);
+        return;
+    }
+
+    fieldBegin = ++pos; // skip ["] begin
+    bool escaped = false;
+    while (pos < end) {
+        if (*pos == '"') {
+            if (pos + 1 < end && *(pos + 1) == '"') {
+                escaped = true;
+                pos += 2;
+                continue;
+            }
+            break;
+        }
+        ++pos;
+    }
+    fieldEnd = pos;
+
+    if (escaped) {
+        buffer = QByteArray(fieldBegin, static_cast<int>(fieldEnd - fieldBegin)).replace("\"\"", "\"");
+        fieldBegin = buffer.constData();
+        fieldEnd = fieldBegin + buffer.size();
+    }
+    trimRange(fieldBegin, fieldEnd);
+
+    // skip ["] end and the garbage before the next separator
+    while (pos < end && *pos != ',' && *pos != '\n')
+        ++pos;
+}
+
+SymlinkMap parseIconFileSymlinkMap(const QString &csvFile, bool *ok) {
+    QFile file(csvFile);
+    *ok = file.open(QIODevice::ReadOnly);
+    if (!*ok) {
+        qWarning() << "Failed on open symlink map file:" << csvFile;
+        return SymlinkMap();
+    }
+
+    QByteArray content;
+    if (const uchar *data = file.size() > 0 ? file.map(0, file.size()) : nullptr) {
+        content = QByteArray::fromRawData(reinterpret_cast<const char *>(data), static_cast<int>(file.size()));
+    } else {
+        content = file.readAll();
+    }
+
+    // Every record is "icon name, symlink names", the symlink names are
+    // separated by the line breaks in a quoted field.
+    SymlinkMap map;
+    QByteArray keyBuffer, valueBuffer, unusedBuffer;
+    const char *pos = content.constData();
+    const char *end = pos + content.size();
+    while (pos < end) {
+        const char *keyBegin, *keyEnd, *valueBegin = nullptr, *valueEnd = nullptr;
+        readCsvField(pos, end, keyBegin, keyEnd, keyBuffer);
+        if (pos < end && *pos == ',') {
+            readCsvField(++pos, end, valueBegin, valueEnd, valueBuffer);
+            // ignore the other fields of this record
+            while (pos < end && *pos == ',') {
+                const char *b, *e;
+                readCsvField(++pos, end, b, e, unusedBuffer);
+            }
+        }
+        if (pos < end)
+            ++pos; // skip [\n]
+
+        if (keyBegin == keyEnd || !valueBegin)
+            continue;
+
+        const QString key = QString::fromUtf8(keyBegin, static_cast<int>(keyEnd - keyBegin));
+        while (valueBegin < valueEnd) {
+            const char *lineEnd = static_cast<const char *>(memchr(valueBegin, '\n', valueEnd - valueBegin));
+            if (!lineEnd)
+                lineEnd = valueEnd;
+            const char *nextLine = lineEnd + 1;
+            trimRange(valueBegin, lineEnd);
+            if (valueBegin < lineEnd)
+                map.insert(key, QString::fromUtf8(valueBegin, static_cast<int>(lineEnd - valueBegin)));
+            valueBegin = nextLine;
+        }
+    }
+
+    qInfo() << "Got symlinks:" << map.size();
+
+    return map;
+}
+
+struct SourceFiles {
+    QStringList files;
+    QStringList symlinks;
+    QStringList directories; // the subdirectories
+};
+
+// Walk the source directory once like QDirIterator with QDir::Files and
+// QDirIterator::Subdirectories, but use the d_type of readdir to classify the
+// entries, only the symlinks and the unknown types need a stat call.
+static void scanSourceDirectory(const QByteArray &path, const QVector<QRegExp> &nameFilters, SourceFiles &result)
+{
+    DIR *dir = opendir(path.constData());
+    if (!dir)
+        return;
+
+    QVector<QPair<QByteArray, unsigned char>> entries;
+    while (const dirent *entry = readdir(dir)) {
+        // Skip ".", ".." and the hidden files
+        if (entry->d_name[0] == '.')
+            continue;
+        entries.append({QByteArray(entry->d_name), entry->d_type});
+    }
+    closedir(dir);
+
+    // Sort the entries to keep the result is same on every file system
+    std::sort(entries.begin(), entries.end());
+
+    auto matched = [&nameFilters](const QString &fileName) {
+        if (nameFilters.isEmpty())
+            return true;
+        for (const auto &i : nameFilters) {
+            if (i.exactMatch(fileName))
+                return true;
+        }
+        return false;
+    };
+
+    for (const auto &entry : qAsConst(entries)) {
+        const QByteArray filePath = path + '/' + entry.first;
+        unsigned char type = entry.second;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(filePath.constData(), &st) != 0)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                type = DT_DIR;
+            else if (S_ISLNK(st.st_mode))
+                type = DT_LNK;
+            else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            result.directories << QFile::decodeName(filePath);
+            scanSourceDirectory(filePath, nameFilters, result);
+        } else if (type == DT_REG) {
+            const QString fileName = QFile::decodeName(entry.first);
+            if (matched(fileName))
+                result.files << QFile::decodeName(filePath);
+        } else if (type == DT_LNK) {
+            // Don't follow the symlinks of directory, and ignore the broken symlinks
+            struct stat st;
+            if (stat(filePath.constData(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            const QString fileName = QFile::decodeName(entry.first);
+            if (matched(fileName))
+                result.symlinks << QFile::decodeName(filePath);
+        }
+    }
+}
+
+struct SymlinkTask {
+    QByteArray target; // the file name of the dci file
+    QByteArray name; // the file name of the symlink
+    int error = 0;
+    bool exists = false;
+};
+
+// Collect the symlinks of all icons, and create them in the end by createLinks
+struct LinkBatch {
+    void add(const QFileInfo &file, const QString &dciFilePath, const SymlinkMap &symlinksMap) {
+        const QStringList &names = symlinksMap.names(file.completeBaseName());
+        if (names.isEmpty())
+            return;
+
+        const QByteArray target = QFile::encodeName(QFileInfo(dciFilePath).fileName());
+        for (const auto &i : names) {
+            const QByteArray name = QFile::encodeName(i + ".dci");
+            const auto it = index.constFind(name);
+            if (it != index.constEnd()) {
+                // The first icon wins if many icons want the same symlink
+                if (links.at(*it).target != target)
+                    conflicts << QString("%1 -> %2").arg(QFile::decodeName(name), QFile::decodeName(target));
+                continue;
+            }
+
+            index.insert(name, links.size());
+            links.append({target, name});
+        }
+    }
+
+    // Add the symlink "dciFilePath" of the duplicate icon to the "targetFilePath"
+    void addDuplicate(const QString &dciFilePath, const QString &targetFilePath) {
+        const QByteArray name = QFile::encodeName(QFileInfo(dciFilePath).fileName());
+        if (index.contains(name))
+            return;
+
+        index.insert(name, links.size());
+        links.append({QFile::encodeName(QFileInfo(targetFilePath).fileName()), name});
+    }
+
+    QVector<SymlinkTask> links;
+    QHash<QByteArray, int> index;
+    QStringList conflicts;
+};
+
+static void createLinks(const QDir &outputDir, LinkBatch &batch, int jobs)
+{
+    if (batch.links.isEmpty() && batch.conflicts.isEmpty())
+        return;
+
+    const int dirFd = open(QFile::encodeName(outputDir.absolutePath()).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        qErrnoWarning("Failed on open the output directory");
+        return;
+    }
+
+    auto link = [dirFd](SymlinkTask &task) {
+        if (symlinkat(task.target.constData(), dirFd, task.name.constData()) == 0)
+            return;
+
+        task.error = errno;
+        if (task.error != EEXIST)
+            return;
+
+        // It's not a conflict if the symlink have been created by the previous build
+        char buffer[PATH_MAX];
+        const ssize_t size = readlinkat(dirFd, task.name.constData(), buffer, sizeof(buffer));
+        if (size == task.target.size() && memcmp(buffer, task.target.constData(), size) == 0) {
+            task.error = 0;
+            task.exists = true;
+        }
+    };
+
+    if (jobs > 1) {
+        QtConcurrent::blockingMap(batch.links, link);
+    } else {
+        for (auto &task : batch.links)
+            link(task);
+    }
+    close(dirFd);
+
+    int created = 0, exists = 0;
+    QStringList failed;
+    for (const auto &task : qAsConst(batch.links)) {
+        if (task.error) {
+            failed << QString("%1 -> %2 (%3)").arg(QFile::decodeName(task.name), QFile::decodeName(task.target),
+                                                   QString::fromLocal8Bit(strerror(task.error)));
+        } else if (task.exists) {
+            ++exists;
+        } else {
+            ++created;
+        }
+    }
+
+    qInfo() << "Created symlinks:" << created << "already exists:" << exists;
+    if (!batch.conflicts.isEmpty())
+        qWarning() << "Ignore the symlinks that want to the other icons:" << batch.conflicts;
+    if (!failed.isEmpty())
+        qWarning() << "Failed on create symlinks:" << failed;
+}
+
+// The layout of the --pack file, all of the numbers are little endian:
+//  header: magic "DCIPACK\0" (8 bytes), version (4 bytes), entry count (4 bytes),
+//          offset of the index (8 bytes), offset of the names (8 bytes)
+//  data: the dci files, every file is aligned to 8 bytes
+//  index: the entries sorted by the icon name, for the binary search on a mmap
+//  entry: offset of the name in names (4 bytes), size of the name (4 bytes), flags (4 bytes),
+//         reserved (4 bytes), offset of the dci file (8 bytes), size of the dci file (8 bytes)
+//  names: the UTF-8 icon names, the alias entries share the data of the dci file
+static const char packMagic[8] = { 'D', 'C', 'I', 'P', 'A', 'C', 'K', '\0' };
+static const int packHeaderSize = 32;
+static const int packEntrySize = 32;
+static const quint32 packAliasFlag = 0x1;
+
+struct PackEntry {
+    QByteArray name;
+    quint32 flags = 0;
+    quint64 offset = 0;
+    quint64 size = 0;
+};
+
+static bool writePackData(QSaveFile &file, const QByteArray &data)
+{
+    return file.write(data) == data.size();
+}
+
+// Pack the dci files and the symlinks of them in the output directory to one file
+static bool writePackFile(const QDir &outputDir, const QString &packFile)
+{
+    QSaveFile file(packFile);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    if (!writePackData(file, QByteArray(packHeaderSize, '\0')))
+        return false;
+
+    const auto files = outputDir.entryInfoList({"*.dci"}, QDir::Files | QDir::System | QDir::NoDotAndDotDot, QDir::Name);
+    QVector<PackEntry> entries;
+    QHash<QString, int> dataEntries; // the file name of a dci file -> entries index
+    quint64 pos = packHeaderSize;
+    for (const auto &i : files) {
+        if (i.isSymLink())
+            continue;
+
+        QFile dciFile(i.absoluteFilePath());
+        if (!dciFile.open(QIODevice::ReadOnly))
+            return false;
+        const QByteArray data = dciFile.readAll();
+        const QByteArray padding((8 - data.size() % 8) % 8, '\0');
+        if (!writePackData(file, data) || !writePackData(file, padding))
+            return false;
+
+        dataEntries.insert(i.fileName(), entries.size());
+        entries.append({i.completeBaseName().toUtf8(), 0, pos, static_cast<quint64>(data.size())});
+        pos += static_cast<quint64>(data.size() + padding.size());
+    }
+
+    for (const auto &i : files) {
+        if (!i.isSymLink())
+            continue;
+
+        const auto target = dataEntries.constFind(QFileInfo(i.symLinkTarget()).fileName());
+        if (target == dataEntries.constEnd() || QFileInfo(i.symLinkTarget()).dir() != outputDir) {
+            qWarning() << "Ignore the symlink to the outside of the output directory:" << i.filePath();
+            continue;
+        }
+
+        PackEntry entry = entries.at(*target);
+        entry.name = i.completeBaseName().toUtf8();
+        entry.flags = packAliasFlag;
+        entries.append(entry);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const PackEntry &e1, const PackEntry &e2) {
+        return e1.name < e2.name;
+    });
+
+    QByteArray index(entries.size() * packEntrySize, '\0');
+    QByteArray names;
+    char *entryData = index.data();
+    for (const auto &i : qAsConst(entries)) {
+        qToLittleEndian<quint32>(static_cast<quint32>(names.size()), entryData);
+        qToLittleEndian<quint32>(static_cast<quint32>(i.name.size()), entryData + 4);
+        qToLittleEndian<quint32>(i.flags, entryData + 8);
+        qToLittleEndian<quint64>(i.offset, entryData + 16);
+        qToLittleEndian<quint64>(i.size, entryData + 24);
+        names += i.name;
+        entryData += packEntrySize;
+    }
+
+    QByteArray header(packHeaderSize, '\0');
+    memcpy(header.data(), packMagic, sizeof(packMagic));
+    qToLittleEndian<quint32>(1, header.data() + 8);
+    qToLittleEndian<quint32>(static_cast<quint32>(entries.size()), header.data() + 12);
+    qToLittleEndian<quint64>(pos, header.data() + 16);
+    qToLittleEndian<quint64>(pos + static_cast<quint64>(index.size()), header.data() + 24);
+
+    if (!writePackData(file, index) || !writePackData(file, names) || !file.seek(0) || !writePackData(file, header))
+        return false;
+
+    qInfo() << "Packed" << dataEntries.size() << "dci files and" << entries.size() - dataEntries.size()
+            << "symlinks to" << packFile;
+    return file.commit();
+}
+
+// Expand the --pack file to the dci files and the symlinks of the aliases
+static bool unpackFile(const QString &packFile, const QDir &outputDir)
+{
+    QFile file(packFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 fileSize = file.size();
+    const uchar *data = fileSize >= packHeaderSize ? file.map(0, fileSize) : nullptr;
+    if (!data || memcmp(data, packMagic, sizeof(packMagic)) != 0) {
+        qWarning() << "Invalid pack file:" << packFile;
+        return false;
+    }
+
+    const quint32 count = qFromLittleEndian<quint32>(data + 12);
+    const quint64 indexOffset = qFromLittleEndian<quint64>(data + 16);
+    const quint64 namesOffset = qFromLittleEndian<quint64>(data + 24);
+    // Compare by the subtractions, the offsets of a broken file may overflow the additions
+    if (namesOffset > quint64(fileSize) || indexOffset < quint64(packHeaderSize) || indexOffset > namesOffset
+            || quint64(count) > (namesOffset - indexOffset) / packEntrySize) {
+        qWarning() << "Invalid pack file:" << packFile;
+        return false;
+    }
+
+    QVector<PackEntry> entries;
+    QHash<quint64, QByteArray> dataNames; // the offset of a dci file -> the file name
+    for (quint32 i = 0; i < count; ++i) {
+        const uchar *entryData = data + indexOffset + i * packEntrySize;
+        const quint64 nameOffset = qFromLittleEndian<quint32>(entryData);
+        const quint32 nameSize = qFromLittleEndian<quint32>(entryData + 4);
+        PackEntry entry;
+        entry.flags = qFromLittleEndian<quint32>(entryData + 8);
+        entry.offset = qFromLittleEndian<quint64>(entryData + 16);
+        entry.size = qFromLittleEndian<quint64>(entryData + 24);
+        const quint64 namesSize = quint64(fileSize) - namesOffset;
+        if (nameOffset > namesSize || nameSize > namesSize - nameOffset
+                || entry.offset < quint64(packHeaderSize) || entry.offset > indexOffset
+                || entry.size > indexOffset - entry.offset) {
+            qWarning() << "Invalid pack file:" << packFile;
+            return false;
+        }
+
+        // The names are the file names in the output directory, not the paths
+        entry.name = QByteArray(reinterpret_cast<const char *>(data + namesOffset + nameOffset),
+                                static_cast<int>(nameSize));
+        if (entry.name.isEmpty() || entry.name == "." || entry.name == ".."
+                || entry.name.contains('/') || entry.name.contains('\0')) {
+            qWarning() << "Invalid icon name in the pack file:" << packFile << entry.name;
+            return false;
+        }
+        if (!(entry.flags & packAliasFlag))
+            dataNames.insert(entry.offset, entry.name);
+        entries.append(entry);
+    }
+
+    for (const auto &i : qAsConst(entries)) {
+        const QString fileName = outputDir.absoluteFilePath(QString::fromUtf8(i.name) + ".dci");
+        if (i.flags & packAliasFlag) {
+            const QByteArray target = dataNames.value(i.offset);
+            if (target.isEmpty() || !QFile::link(QString::fromUtf8(target) + ".dci", fileName))
+                qWarning() << "Failed on create symlink" << fileName;
+            continue;
+        }
+
+        QSaveFile dciFile(fileName);
+        if (!dciFile.open(QIODevice::WriteOnly)
+                || dciFile.write(reinterpret_cast<const char *>(data + i.offset), static_cast<qint64>(i.size))
+                != static_cast<qint64>(i.size)
+                || !dciFile.commit()) {
+            qWarning() << "Failed on write the dci file:" << fileName;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static QString darkIconFile(const QFileInfo &file)
+{
+    return file.dir().absoluteFilePath("dark/" + file.fileName());
+}
+
+struct IconTask {
+    QFileInfo file;
+    QString dciFilePath;
+    QJsonObject manifestEntry;
+    // The dci file of the incremental mode is not need to rebuild
+    bool upToDate = false;
+    bool written = false;
+    IconStats stats;
+    // The --dedup mode links to the dci file of the first icon with the same sources
+    IconTask *duplicateOf = nullptr;
+    qint64 dedupBytes = 0;
+    // The reason of the failure, it's reported in the end of the build
+    QString error;
+    // The sources of the same name in the other directories of --merge
+    QStringList alternates;
+};
+
+static const QString manifestFileName = QStringLiteral(".dci-icon-theme.manifest");
+static const QString manifestJournalFileName = QStringLiteral(".dci-icon-theme.manifest.journal");
+
+struct IconManifest {
+    QString settings;
+    // source file path -> { "output", "source", "dark", "duplicate_of" }
+    QJsonObject icons;
+};
+
+static IconManifest loadManifest(const QDir &outputDir)
+{
+    IconManifest manifest;
+    QFile file(outputDir.absoluteFilePath(manifestFileName));
+    if (file.open(QIODevice::ReadOnly)) {
+        const QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+        manifest.settings = root.value("settings").toString();
+        manifest.icons = root.value("icons").toObject();
+    }
+
+    QFile journal(outputDir.absoluteFilePath(manifestJournalFileName));
+    if (!journal.open(QIODevice::ReadOnly))
+        return manifest;
+
+    const QJsonObject header = QJsonDocument::fromJson(journal.readLine()).object();
+    if (!header.contains("settings"))
+        return manifest;
+
+    // The old icons are rebuilt by the settings of the journal, only keep their outputs to remove the stale files
+    const QString settings = header.value("settings").toString();
+    if (settings != manifest.settings) {
+        for (auto i = manifest.icons.begin(); i != manifest.icons.end(); ++i) {
+            QJsonObject entry = i.value().toObject();
+            entry.remove("source");
+            i.value() = entry;
+        }
+        manifest.settings = settings;
+    }
+
+    // The last line may be truncated by the interrupted build
+    while (!journal.atEnd()) {
+        const QJsonObject line = QJsonDocument::fromJson(journal.readLine()).object();
+        if (line.value("source").isString() && line.value("entry").isObject())
+            manifest.icons.insert(line.value("source").toString(), line.value("entry"));
+    }
+
+    return manifest;
+}
+
+static bool saveManifest(const QDir &outputDir, const IconManifest &manifest)
+{
+    QSaveFile file(outputDir.absoluteFilePath(manifestFileName));
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    const QJsonObject root {
+        {"settings", manifest.settings},
+        {"icons", manifest.icons}
+    };
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    if (!file.commit())
+        return false;
+
+    // The journal is merged to the manifest
+    const QString journal = outputDir.absoluteFilePath(manifestJournalFileName);
+    return !QFile::exists(journal) || QFile::remove(journal);
+}
+
+// Only hash the file content again when the mtime or size are changed
+static QJsonObject fileStamp(const QFileInfo &file, const QJsonObject &oldStamp)
+{
+    if (!file.exists())
+        return QJsonObject();
+
+    QJsonObject stamp {
+        {"mtime", QString::number(file.lastModified().toMSecsSinceEpoch())},
+        {"size", QString::number(file.size())}
+    };
+
+    if (stamp.value("mtime") == oldStamp.value("mtime")
+            && stamp.value("size") == oldStamp.value("size")
+            && oldStamp.contains("hash")) {
+        stamp.insert("hash", oldStamp.value("hash"));
+        return stamp;
+    }
+
+    QFile data(file.absoluteFilePath());
+    if (data.open(QIODevice::ReadOnly)) {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(&data);
+        stamp.insert("hash", QString::fromLatin1(hash.result().toHex()));
+    }
+
+    return stamp;
+}
+
+static QJsonObject iconManifestEntry(const QFileInfo &file, const QString &dciFilePath, const QJsonObject &oldEntry,
+                                     const QStringList &alternates = QStringList())
+{
+    const QFileInfo darkIcon(darkIconFile(file));
+    QJsonObject entry {
+        {"output", QFileInfo(dciFilePath).fileName()},
+        {"source", fileStamp(file, oldEntry.value("source").toObject())},
+        {"dark", fileStamp(darkIcon, oldEntry.value("dark").toObject())}
+    };
+
+    // The other sources of --merge, source file path -> { "source", "dark" }
+    if (!alternates.isEmpty()) {
+        const QJsonObject oldAlternates = oldEntry.value("alternates").toObject();
+        QJsonObject stamps;
+        for (const auto &i : alternates) {
+            const QFileInfo alternate(i);
+            const QJsonObject oldStamps = oldAlternates.value(i).toObject();
+            stamps.insert(i, QJsonObject {
+                              {"source", fileStamp(alternate, oldStamps.value("source").toObject())},
+                              {"dark", fileStamp(QFileInfo(darkIconFile(alternate)), oldStamps.value("dark").toObject())}
+                          });
+        }
+        entry.insert("alternates", stamps);
+    }
+
+    return entry;
+}
+
+static bool isSameIconContent(const QJsonObject &entry, const QJsonObject &oldEntry)
+{
+    const QJsonObject source = entry.value("source").toObject();
+    if (!source.contains("hash"))
+        return false;
+
+    auto hash = [](const QJsonObject &object, const char *key) {
+        return object.value(key).toObject().value("hash");
+    };
+    const QJsonObject alternates = entry.value("alternates").toObject();
+    const QJsonObject oldAlternates = oldEntry.value("alternates").toObject();
+    if (alternates.keys() != oldAlternates.keys())
+        return false;
+    for (auto i = alternates.constBegin(); i != alternates.constEnd(); ++i) {
+        const QJsonObject old = oldAlternates.value(i.key()).toObject();
+        if (hash(i.value().toObject(), "source") != hash(old, "source")
+                || hash(i.value().toObject(), "dark") != hash(old, "dark")) {
+            return false;
+        }
+    }
+
+    return entry.value("output") == oldEntry.value("output")
+            && source.value("hash") == oldEntry.value("source").toObject().value("hash")
+            && hash(entry, "dark") == hash(oldEntry, "dark");
+}
+
+// The outputs of --dedup are the symlinks to the dci files of their first icons, they are up
+// to date only if the symlink and its target are unchanged, the other outputs are not symlinks.
+static void checkDuplicateOutputs(QVector<IconTask> &tasks, const IconManifest &oldManifest)
+{
+    QHash<QString, int> outputs;
+    for (int i = 0; i < tasks.size(); ++i)
+        outputs.insert(QFileInfo(tasks.at(i).dciFilePath).fileName(), i);
+
+    auto duplicateOf = [&oldManifest](const IconTask &task) {
+        return oldManifest.icons.value(task.file.absoluteFilePath()).toObject().value("duplicate_of").toString();
+    };
+
+    // The targets are never the duplicates, so check them at first
+    for (auto &task : tasks) {
+        if (task.upToDate && duplicateOf(task).isEmpty())
+            task.upToDate = !QFileInfo(task.dciFilePath).isSymLink();
+    }
+
+    for (auto &task : tasks) {
+        const QString target = duplicateOf(task);
+        if (!task.upToDate || target.isEmpty())
+            continue;
+
+        const QFileInfo output(task.dciFilePath);
+        const int index = outputs.value(target, -1);
+        task.upToDate = output.isSymLink() && QFileInfo(output.symLinkTarget()).fileName() == target
+                && index >= 0 && tasks.at(index).upToDate;
+        if (task.upToDate)
+            task.duplicateOf = &tasks[index];
+    }
+}
+
+// Remove the outputs of the deleted source files and the symlinks to them
+static void removeStaleOutputs(const QDir &outputDir, const QSet<QString> &staleFiles)
+{
+    if (staleFiles.isEmpty())
+        return;
+
+    for (const auto &i : staleFiles) {
+        qInfo() << "Remove the dci file of the deleted source:" << outputDir.absoluteFilePath(i);
+        QFile::remove(outputDir.absoluteFilePath(i));
+    }
+
+    const auto entries = outputDir.entryInfoList(QDir::Files | QDir::System | QDir::NoDotAndDotDot);
+    for (const auto &i : entries) {
+        if (i.isSymLink() && staleFiles.contains(QFileInfo(i.symLinkTarget()).fileName()))
+            QFile::remove(i.absoluteFilePath());
+    }
+}
+
+// The layout of a dci file written by DDciFile:
+//  header: magic "DCI\0" (4 bytes), version (1 byte), count of the top level files (3 bytes)
+//  file: type (1 byte, DDciFile::FileType), name (63 bytes), content size (8 bytes), content
+// The content of a directory is its child files.
+static const int dciHeaderSize = 8;
+static const int dciFileNameSize = 63;
+static const int dciFileMetaSize = 1 + dciFileNameSize + 8;
+
+struct DciEntry {
+    int type = DDciFile::UnknowFile;
+    QByteArray name;
+    qint64 offset = 0; // the offset of the content
+    qint64 size = 0;
+};
+
+// Read the metas of the files in [begin, end) without the contents, read "count" files
+// if it's not negative, or else read until the end.
+static bool readDciEntries(const uchar *data, qint64 begin, qint64 end, int count, QVector<DciEntry> &entries)
+{
+    qint64 pos = begin;
+    while (count < 0 ? pos < end : entries.size() < count) {
+        // Compare by the subtraction, the sizes of a broken file may overflow the additions
+        if (pos < 0 || pos > end || end - pos < dciFileMetaSize)
+            return false;
+
+        DciEntry entry;
+        entry.type = data[pos];
+        const char *name = reinterpret_cast<const char *>(data + pos + 1);
+        entry.name = QByteArray(name, static_cast<int>(qstrnlen(name, dciFileNameSize)));
+        entry.size = qFromLittleEndian<qint64>(data + pos + 1 + dciFileNameSize);
+        entry.offset = pos + dciFileMetaSize;
+        if (entry.size < 0 || entry.size > end - entry.offset)
+            return false;
+
+        pos = entry.offset + entry.size;
+        entries.append(entry);
+    }
+
+    return true;
+}
+
+static bool readDciHeader(const uchar *data, qint64 size, int *fileCount)
+{
+    if (size < dciHeaderSize || memcmp(data, "DCI\0", 4) != 0)
+        return false;
+
+    *fileCount = data[5] | (data[6] << 8) | (data[7] << 16);
+    return true;
+}
+
+// Write a dci file in the layout above to the file descriptor directly, the contents are
+// written as soon as they are given, and the sizes of the directories are patched in the end
+// of them, so it doesn't need to keep the whole dci file in memory like DDciFile. The writer
+// only runs in the write stage, the encoded images of an icon are still held in memory until then.
+class DciStreamWriter
+{
+public:
+    explicit DciStreamWriter(const QString &fileName)
+        : m_fd(open(QFile::encodeName(fileName).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) {
+        static const char header[dciHeaderSize] = { 'D', 'C', 'I', '\0', 1, 0, 0, 0 };
+        m_ok = m_fd >= 0 && writeData(header, dciHeaderSize);
+    }
+
+    ~DciStreamWriter() {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    bool beginDirectory(const QByteArray &name) {
+        if (m_directories.isEmpty())
+            ++m_topCount;
+        m_directories.append(m_pos);
+        return writeMeta(DDciFile::Directory, name, 0);
+    }
+
+    bool endDirectory() {
+        if (m_directories.isEmpty())
+            return m_ok = false;
+
+        const qint64 metaPos = m_directories.takeLast();
+        return patchSize(metaPos, m_pos - metaPos - dciFileMetaSize);
+    }
+
+    bool writeFile(const QByteArray &name, const QByteArray &data) {
+        if (m_directories.isEmpty())
+            ++m_topCount;
+        return writeMeta(DDciFile::File, name, data.size()) && writeData(data.constData(), data.size());
+    }
+
+    bool writeSymlink(const QByteArray &name, const QByteArray &target) {
+        if (m_directories.isEmpty())
+            ++m_topCount;
+        return writeMeta(DDciFile::Symlink, name, target.size()) && writeData(target.constData(), target.size());
+    }
+
+    bool finish() {
+        if (!m_ok || !m_directories.isEmpty() || m_topCount > 0xffffff)
+            return false;
+
+        const uchar count[3] = { uchar(m_topCount), uchar(m_topCount >> 8), uchar(m_topCount >> 16) };
+        m_ok = pwrite(m_fd, count, sizeof(count), 5) == sizeof(count) && close(m_fd) == 0;
+        m_fd = -1;
+        return m_ok;
+    }
+
+private:
+    bool writeMeta(int type, const QByteArray &name, qint64 size) {
+        if (!m_ok || name.size() > dciFileNameSize)
+            return m_ok = false;
+
+        char meta[dciFileMetaSize] = {};
+        meta[0] = static_cast<char>(type);
+        memcpy(meta + 1, name.constData(), static_cast<size_t>(name.size()));
+        qToLittleEndian<qint64>(size, meta + 1 + dciFileNameSize);
+        return writeData(meta, dciFileMetaSize);
+    }
+
+    bool patchSize(qint64 metaPos, qint64 size) {
+        char data[8];
+        qToLittleEndian<qint64>(size, data);
+        return m_ok = m_ok && pwrite(m_fd, data, sizeof(data), metaPos + 1 + dciFileNameSize) == sizeof(data);
+    }
+
+    bool writeData(const char *data, qint64 size) {
+        while (m_ok && size > 0) {
+            const ssize_t written = ::write(m_fd, data, static_cast<size_t>(size));
+            if (written <= 0)
+                return m_ok = false;
+            data += written;
+            size -= written;
+            m_pos += written;
+        }
+        return m_ok;
+    }
+
+    int m_fd;
+    bool m_ok = false;
+    qint64 m_pos = 0;
+    int m_topCount = 0;
+    QVector<qint64> m_directories; // the offsets of the metas of the unfinished directories
+};
+
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(int capacity)
+        : m_capacity(capacity) {}
+
+    void push(T item) {
+        QMutexLocker locker(&m_mutex);
+        while (m_items.size() >= m_capacity)
+            m_notFull.wait(&m_mutex);
+        m_items.enqueue(std::move(item));
+        m_notEmpty.wakeOne();
+    }
+
+    // Return false if the queue is closed and all items have been taken
+    bool pop(T &item) {
+        QMutexLocker locker(&m_mutex);
+        while (m_items.isEmpty() && !m_closed)
+            m_notEmpty.wait(&m_mutex);
+        if (m_items.isEmpty())
+            return false;
+        item = m_items.dequeue();
+        m_notFull.wakeOne();
+        return true;
+    }
+
+    void close() {
+        QMutexLocker locker(&m_mutex);
+        m_closed = true;
+        m_notEmpty.wakeAll();
+    }
+
+private:
+    const int m_capacity;
+    bool m_closed = false;
+    QQueue<T> m_items;
+    QMutex m_mutex;
+    QWaitCondition m_notFull;
+    QWaitCondition m_notEmpty;
+};
+
+// Admit the icons to the pipeline against a memory budget, an icon larger than
+// the budget is admitted when no other icon is in the pipeline, so it runs alone.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(qint64 limit)
+        : m_limit(limit) {}
+
+    void acquire(qint64 bytes) {
+        QMutexLocker locker(&m_mutex);
+        while (m_used > 0 && m_used + bytes > m_limit)
+            m_released.wait(&m_mutex);
+        m_used += bytes;
+    }
+
+    void release(qint64 bytes) {
+        QMutexLocker locker(&m_mutex);
+        m_used -= bytes;
+        m_released.wakeAll();
+    }
+
+private:
+    const qint64 m_limit;
+    qint64 m_used = 0;
+    QMutex m_mutex;
+    QWaitCondition m_released;
+};
+
+// An icon passes through the read, encode and write stages of convertIcons
+struct IconJob {
+    IconTask *task = nullptr;
+    // The estimated memory of the icon, it's released to the MemoryBudget when it's written
+    qint64 memory = 0;
+    bool hasDark = false;
+    // The dark icon is same as the light icon, it's linked in the dci file
+    bool darkDeduplicated = false;
+    QByteArray light;
+    QByteArray dark;
+    // The data of the IconTask::alternates and their dark icons, a missing dark icon is empty
+    QVector<QByteArray> alternates;
+    QVector<QByteArray> darkAlternates;
+    EncodedFiles lightFiles;
+    EncodedFiles darkFiles;
+};
+
+static bool readIcon(IconJob &job)
+{
+    if (!readFileData(job.task->file.filePath(), job.light)) {
+        job.task->error = "Can't read the source file";
+        return false;
+    }
+
+    const QString darkFile = darkIconFile(job.task->file);
+    job.hasDark = QFileInfo::exists(darkFile);
+    if (job.hasDark)
+        readFileData(darkFile, job.dark);
+
+    for (const auto &i : qAsConst(job.task->alternates)) {
+        QByteArray data, dark;
+        if (!readFileData(i, data)) {
+            job.task->error = "Can't read the source file " + i;
+            return false;
+        }
+
+        const QString darkFile = darkIconFile(QFileInfo(i));
+        if (QFileInfo::exists(darkFile) && readFileData(darkFile, dark))
+            job.hasDark = true;
+        job.alternates << data;
+        job.darkAlternates << dark;
+    }
+
+    return true;
+}
+
+// Estimate the peak memory of an icon in the pipeline by the image headers of the sources, before
+// decoding them: the sources, the decoded images, the scaled image and the pixels given to libwebp
+// while encoding, and the encoded files (assume 1/4 of the pixels) that are kept until written.
+static qint64 estimateIconMemory(const IconJob &job, const ConvertOptions &options)
+{
+    qint64 pixelBytes = 0;
+    for (int size : options.sizes) {
+        for (int scale : options.scales)
+            pixelBytes += qint64(size * scale) * (size * scale) * 4;
+    }
+    const qint64 maxPixelBytes = qint64(options.maxImageSize()) * options.maxImageSize() * 4;
+
+    QVector<QPair<const QByteArray *, QString>> sources {
+        { &job.light, job.task->file.filePath() },
+        { &job.dark, darkIconFile(job.task->file) }
+    };
+    for (int i = 0; i < job.alternates.size(); ++i) {
+        const QString &file = job.task->alternates.at(i);
+        sources.append({ &job.alternates.at(i), file });
+        sources.append({ &job.darkAlternates.at(i), darkIconFile(QFileInfo(file)) });
+    }
+
+    qint64 memory = 0;
+    for (const auto &i : qAsConst(sources)) {
+        memory += i.first->size();
+        if (i.first->isEmpty())
+            continue;
+
+        // The SVG images are rendered at the pixel sizes, there is no decoded image
+        if (!isSvgFile(i.second)) {
+            const QSize size = imageHeaderSize(*i.first, QFileInfo(i.second).suffix().toLatin1());
+            memory += qint64(size.width()) * size.height() * 4;
+        }
+        memory += maxPixelBytes * 2 + pixelBytes / 4;
+    }
+
+    return memory;
+}
+
+// A source of an icon of --merge
+struct IconSource {
+    QString file;
+    const QByteArray *data;
+    QSize size;
+};
+
+static void readIconSourceSizes(QVector<IconSource> &sources)
+{
+    for (auto &i : sources) {
+        if (!isSvgFile(i.file))
+            i.size = imageHeaderSize(*i.data, QFileInfo(i.file).suffix().toLatin1());
+    }
+}
+
+// The rank of the source for the pixel size, the smaller is better: the raster source of the same
+// size, the SVG source, the smallest larger source, the largest source.
+static QPair<int, int> iconSourceRank(const IconSource &source, int pixelSize)
+{
+    if (isSvgFile(source.file))
+        return qMakePair(1, 0);
+    const int width = source.size.width();
+    if (width == pixelSize)
+        return qMakePair(0, 0);
+    return width > pixelSize ? qMakePair(2, width - pixelSize) : qMakePair(3, pixelSize - width);
+}
+
+// Choose the best source of the pixel size by iconSourceRank, the former source wins in a tie
+static int bestIconSource(const QVector<IconSource> &sources, int pixelSize)
+{
+    int best = 0;
+    for (int i = 1; i < sources.size(); ++i) {
+        if (iconSourceRank(sources.at(i), pixelSize) < iconSourceRank(sources.at(best), pixelSize))
+            best = i;
+    }
+
+    return best;
+}
+
+// Encode every pixel size of the mode from the best source, so only the pixel sizes without a native
+// source are resampled, the files are in the order of encodeImage. The sizes of the sources are read
+// by readIconSourceSizes. If the "lightSources" of the dark mode are given, the pixel sizes that the
+// light sources are better are not encoded, the writers link them to the light images.
+static bool encodeIconSources(const QVector<IconSource> &sources, const QString &mode, const ConvertOptions &options,
+                              IconStats &stats, EncodedFiles &files,
+                              const QVector<IconSource> *lightSources = nullptr)
+{
+    QMap<int, QList<int>> sourcePixelSizes;
+    for (int size : options.sizes) {
+        for (int scale : options.scales) {
+            const int pixelSize = size * scale;
+            const int best = bestIconSource(sources, pixelSize);
+            // e.g. don't upscale a 16px dark source to 512px while the light source is 256px
+            if (lightSources && iconSourceRank(sources.at(best), pixelSize)
+                    > iconSourceRank(lightSources->at(bestIconSource(*lightSources, pixelSize)), pixelSize)) {
+                continue;
+            }
+
+            QList<int> &pixelSizes = sourcePixelSizes[best];
+            if (!pixelSizes.contains(pixelSize))
+                pixelSizes << pixelSize;
+        }
+    }
+
+    EncodedFiles encodedFiles;
+    for (auto i = sourcePixelSizes.constBegin(); i != sourcePixelSizes.constEnd(); ++i) {
+        const IconSource &source = sources.at(i.key());
+        if (!encodeImage(*source.data, source.file, mode, options, stats, encodedFiles, i.value()))
+            return false;
+    }
+
+    QHash<QString, QByteArray> encodedData;
+    for (const auto &i : qAsConst(encodedFiles))
+        encodedData.insert(i.first, i.second);
+    for (int size : options.sizes) {
+        for (int scale : options.scales) {
+            const QString path = QString("/%1/%2/%3/1.webp").arg(size).arg(mode).arg(scale);
+            if (encodedData.contains(path))
+                files.append({path, encodedData.value(path)});
+        }
+    }
+
+    return true;
+}
+
+static bool encodeIcon(IconJob &job, const ConvertOptions &options)
+{
+    IconTask *task = job.task;
+    dciFailed = false;
+    bool ok = false;
+    bool darkOk = true;
+    if (task->alternates.isEmpty()) {
+        ok = encodeImage(job.light, task->file.filePath(), "normal.light", options, task->stats, job.lightFiles);
+        if (ok && job.hasDark)
+            darkOk = encodeImage(job.dark, darkIconFile(task->file), "normal.dark", options, task->stats, job.darkFiles);
+    } else {
+        QVector<IconSource> lightSources { { task->file.filePath(), &job.light } };
+        QVector<IconSource> darkSources;
+        if (!job.dark.isEmpty())
+            darkSources.append({ darkIconFile(task->file), &job.dark });
+        for (int i = 0; i < task->alternates.size(); ++i) {
+            lightSources.append({ task->alternates.at(i), &job.alternates.at(i) });
+            if (!job.darkAlternates.at(i).isEmpty())
+                darkSources.append({ darkIconFile(QFileInfo(task->alternates.at(i))), &job.darkAlternates.at(i) });
+        }
+
+        readIconSourceSizes(lightSources);
+        readIconSourceSizes(darkSources);
+        ok = encodeIconSources(lightSources, "normal.light", options, task->stats, job.lightFiles);
+        job.hasDark = !darkSources.isEmpty();
+        if (ok && job.hasDark)
+            darkOk = encodeIconSources(darkSources, "normal.dark", options, task->stats, job.darkFiles, &lightSources);
+    }
+
+    // Free the sources before waiting in the queue of the write stage
+    job.light.clear();
+    job.dark.clear();
+    job.alternates.clear();
+    job.darkAlternates.clear();
+
+    if (!ok) {
+        task->error = "Can't decode the image";
+    } else if (!darkOk) {
+        // Don't write the dci file without the dark images
+        task->error = "Can't decode the dark image";
+        return false;
+    } else if (dciFailed) {
+        task->error = "Failed on encoding the image";
+        return false;
+    }
+    return ok;
+}
+
+// Write the files of the "mode" directory of the "size" directory, the layout is same as writeIcon
+static bool streamEncodedFiles(DciStreamWriter &writer, const EncodedFiles &files, int size, const QString &mode)
+{
+    const QString prefix = QString("/%1/%2/").arg(size).arg(mode);
+    for (const auto &i : files) {
+        if (!i.first.startsWith(prefix))
+            continue;
+
+        // <scale>/1.webp
+        const QStringList names = i.first.mid(prefix.size()).split('/');
+        Q_ASSERT(names.size() == 2);
+        if (!writer.beginDirectory(names.first().toUtf8())
+                || !writer.writeFile(names.last().toUtf8(), i.second)
+                || !writer.endDirectory()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool streamIcon(IconJob &job, const ConvertOptions &options)
+{
+    QHash<QString, QByteArray> darkFiles;
+    for (const auto &i : qAsConst(job.darkFiles))
+        darkFiles.insert(i.first, i.second);
+
+    DciStreamWriter writer(temporaryFilePath(job.task->dciFilePath));
+    for (int size : options.sizes) {
+        if (!writer.beginDirectory(QByteArray::number(size))
+                || !writer.beginDirectory("normal.light")
+                || !streamEncodedFiles(writer, job.lightFiles, size, "normal.light")
+                || !writer.endDirectory()
+                || !writer.beginDirectory("normal.dark")) {
+            return false;
+        }
+
+        // The pixel sizes without the dark images link to the light images like recursionLink
+        const QString prefix = QString("/%1/normal.light/").arg(size);
+        for (const auto &i : qAsConst(job.lightFiles)) {
+            if (!i.first.startsWith(prefix))
+                continue;
+            const QStringList names = i.first.mid(prefix.size()).split('/');
+            const QString darkFile = QString("/%1/normal.dark/").arg(size) + names.join('/');
+            if (!writer.beginDirectory(names.first().toUtf8())
+                    || !(darkFiles.contains(darkFile)
+                         ? writer.writeFile(names.last().toUtf8(), darkFiles.value(darkFile))
+                         : writer.writeSymlink(names.last().toUtf8(), i.first.toUtf8()))
+                    || !writer.endDirectory()) {
+                return false;
+            }
+        }
+
+        if (!writer.endDirectory() || !writer.endDirectory())
+            return false;
+    }
+
+    return writer.finish();
+}
+
+static void writeIcon(IconJob &job, const ConvertOptions &options)
+{
+    IconTask *task = job.task;
+
+    qInfo() << "Wrting to dci file:" << task->dciFilePath;
+
+    // The incremental mode replaces the outdated dci file by the rename of
+    // the temporary file, the old file is kept if the new file is failed.
+    const QString tempFile = temporaryFilePath(task->dciFilePath);
+    QFile::remove(tempFile);
+    dciFailed = false;
+    auto finish = [task, &tempFile] {
+        if (dciFailed) {
+            QFile::remove(tempFile);
+            task->error = "Failed on writing the dci file";
+            return;
+        }
+        task->stats.bytesOut = QFileInfo(task->dciFilePath).size();
+        task->written = true;
+    };
+
+    if (job.darkDeduplicated) {
+        for (const auto &i : qAsConst(job.lightFiles))
+            task->dedupBytes += i.second.size();
+    }
+
+    if (options.streamWriter) {
+        QElapsedTimer timer;
+        timer.start();
+        dciChecker(streamIcon(job, options) && commitTemporaryFile(task->dciFilePath));
+        task->stats.write = timer.nsecsElapsed();
+        finish();
+        return;
+    }
+
+    DDciFile dciFile;
+
+    for (int size : options.sizes) {
+        dciChecker(dciFile.mkdir(QString("/%1").arg(size)));
+        dciChecker(dciFile.mkdir(QString("/%1/normal.light").arg(size)));
+    }
+    writeEncodedFiles(dciFile, job.lightFiles);
+
+    for (int size : options.sizes)
+        dciChecker(dciFile.mkdir(QString("/%1/normal.dark").arg(size)));
+    // The pixel sizes without the dark images link to the light images
+    QHash<QString, QByteArray> darkFiles;
+    for (const auto &i : qAsConst(job.darkFiles))
+        darkFiles.insert(i.first, i.second);
+    for (int size : options.sizes) {
+        for (int scale : options.scales) {
+            const QString darkDir = QString("/%1/normal.dark/%2").arg(size).arg(scale);
+            dciChecker(dciFile.mkdir(darkDir));
+            if (darkFiles.contains(darkDir + "/1.webp"))
+                dciChecker(dciFile.writeFile(darkDir + "/1.webp", darkFiles.value(darkDir + "/1.webp")));
+            else
+                dciChecker(recursionLink(dciFile, QString("/%1/normal.light/%2").arg(size).arg(scale), darkDir));
+        }
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    // Skip the serialization if the dci file is failed already
+    dciChecker(!dciFailed && dciFile.writeToFile(tempFile) && commitTemporaryFile(task->dciFilePath));
+    task->stats.write = timer.nsecsElapsed();
+    finish();
+}
+
+// Convert the icons by a pipeline: a thread reads the source files, the "jobs" threads decode,
+// scale and encode the images, and the current thread assembles and writes the dci files.
+// The stages are connected by bounded queues to limit the memory of the waiting icons.
+static void convertIcons(QVector<IconTask> &tasks, const ConvertOptions &options, int jobs)
+{
+    const int queueSize = jobs * 2;
+    BoundedQueue<IconJob> readQueue(queueSize);
+    MemoryBudget memoryBudget(options.maxMemory);
+    BoundedQueue<IconJob> encodedQueue(queueSize);
+    IconTask *taskList = tasks.data();
+    const int taskCount = tasks.size();
+
+    QScopedPointer<QThread> reader(QThread::create([&] {
+        // The hashes of the light and dark sources -> the first icon of them, the
+        // icons are read in order, so the chosen icon is same in every build.
+        QHash<QByteArray, IconTask *> sources;
+        for (int i = 0; i < taskCount && !dciFatal.loadAcquire(); ++i) {
+            IconJob job;
+            job.task = taskList + i;
+            if (job.task->upToDate || !readIcon(job))
+                continue;
+
+            // The icons of --merge are not same if any of their sources are different
+            if (options.dedup && job.task->alternates.isEmpty()) {
+                const QByteArray lightHash = QCryptographicHash::hash(job.light, QCryptographicHash::Sha1);
+                QByteArray darkHash;
+                if (job.hasDark) {
+                    darkHash = QCryptographicHash::hash(job.dark, QCryptographicHash::Sha1);
+                    if (darkHash == lightHash) {
+                        job.hasDark = false;
+                        job.darkDeduplicated = true;
+                        job.dark.clear();
+                        darkHash.clear();
+                    }
+                }
+
+                const QByteArray key = lightHash + darkHash;
+                if (IconTask *first = sources.value(key)) {
+                    job.task->duplicateOf = first;
+                    continue;
+                }
+                sources.insert(key, job.task);
+            }
+
+            // Wait for the written icons if the new icon is over the budget
+            if (options.maxMemory > 0) {
+                job.memory = estimateIconMemory(job, options);
+                memoryBudget.acquire(job.memory);
+            }
+            readQueue.push(std::move(job));
+        }
+        readQueue.close();
+    }));
+
+    QAtomicInt runningEncoders(jobs);
+    QVector<QThread *> encoders;
+    for (int i = 0; i < jobs; ++i) {
+        encoders << QThread::create([&] {
+            IconJob job;
+            // Keep draining the queue after a fatal failure, the reader may wait for the budget
+            while (readQueue.pop(job)) {
+                if (!dciFatal.loadAcquire() && encodeIcon(job, options))
+                    encodedQueue.push(std::move(job));
+                else if (job.memory > 0)
+                    memoryBudget.release(job.memory);
+            }
+            if (!runningEncoders.deref())
+                encodedQueue.close();
+        });
+    }
+
+    beginWorkers();
+    reader->start();
+    for (auto encoder : qAsConst(encoders))
+        encoder->start();
+
+    IconJob job;
+    while (encodedQueue.pop(job)) {
+        if (!dciFatal.loadAcquire())
+            writeIcon(job, options);
+        if (options.journal && job.task->written
+                && !options.journal->append(job.task->file.absoluteFilePath(), job.task->manifestEntry)) {
+            qWarning() << "Failed on write the manifest journal of the icon:" << job.task->file.filePath();
+        }
+        if (job.memory > 0)
+            memoryBudget.release(job.memory);
+    }
+
+    reader->wait();
+    for (auto encoder : qAsConst(encoders))
+        encoder->wait();
+    qDeleteAll(encoders);
+    endWorkers();
+
+    qint64 dedupBytes = 0;
+    int duplicates = 0;
+    for (auto &task : tasks) {
+        if (task.upToDate) {
+            task.written = true;
+        } else if (task.duplicateOf) {
+            // Replace the old output of the incremental mode by the symlink
+            if (QFileInfo(task.dciFilePath).exists() || QFileInfo(task.dciFilePath).isSymLink())
+                QFile::remove(task.dciFilePath);
+            task.written = task.duplicateOf->written;
+            if (task.written) {
+                ++duplicates;
+                task.dedupBytes = task.duplicateOf->stats.bytesOut;
+            }
+        }
+        dedupBytes += task.dedupBytes;
+
+        // The incremental mode rebuilds the symlink when its target is changed
+        if (task.duplicateOf && !task.manifestEntry.isEmpty())
+            task.manifestEntry.insert("duplicate_of", QFileInfo(task.duplicateOf->dciFilePath).fileName());
+    }
+
+    if (options.dedup)
+        qInfo() << "Deduplicated icons:" << duplicates << "saved bytes:" << dedupBytes;
+}
+
+static QList<int> parseNumberList(const QString &value, bool *ok)
+{
+    QList<int> list;
+    for (const auto &i : value.split(',')) {
+        if (i.isEmpty())
+            continue;
+        const int number = i.trimmed().toInt(ok);
+        if (!*ok || number <= 0) {
+            *ok = false;
+            return {};
+        }
+        if (!list.contains(number))
+            list.append(number);
+    }
+
+    *ok = !list.isEmpty();
+    std::sort(list.begin(), list.end());
+    return list;
+}
+
+enum DarkThemeState {
+    InvalidDciFile,
+    DarkThemeComplete,
+    DarkThemeMissing
+};
+
+// Check whether every "*.light" directory has the "*.dark" sibling by the directory
+// table of the dci file, the contents of the images are not read.
+static DarkThemeState darkThemeState(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return InvalidDciFile;
+
+    const qint64 size = file.size();
+    const uchar *data = size > 0 ? file.map(0, size) : nullptr;
+    int fileCount = 0;
+    if (!data || !readDciHeader(data, size, &fileCount))
+        return InvalidDciFile;
+
+    QVector<DciEntry> topEntries;
+    if (!readDciEntries(data, dciHeaderSize, size, fileCount, topEntries))
+        return InvalidDciFile;
+
+    for (const auto &i : qAsConst(topEntries)) {
+        if (i.type != DDciFile::Directory)
+            continue;
+
+        QVector<DciEntry> children;
+        if (!readDciEntries(data, i.offset, i.offset + i.size, -1, children))
+            return InvalidDciFile;
+
+        QSet<QByteArray> names;
+        for (const auto &j : qAsConst(children))
+            names.insert(j.name);
+        for (const auto &j : qAsConst(children)) {
+            if (j.type == DDciFile::Directory && j.name.endsWith(".light")
+                    && !names.contains(j.name.left(j.name.size() - 5) + "dark")) {
+                return DarkThemeMissing;
+            }
+        }
+    }
+
+    return DarkThemeComplete;
+}
+
+struct IconVariant {
+    int size = 0;
+    int scale = 0;
+    QByteArray mode; // e.g. "normal.light"
+};
+
+// Read the size/scale/mode directories of a dci file by the directory table
+static bool readIconVariants(const QString &fileName, QVector<IconVariant> &variants)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 size = file.size();
+    const uchar *data = size > 0 ? file.map(0, size) : nullptr;
+    int fileCount = 0;
+    QVector<DciEntry> sizeEntries;
+    if (!data || !readDciHeader(data, size, &fileCount)
+            || !readDciEntries(data, dciHeaderSize, size, fileCount, sizeEntries)) {
+        return false;
+    }
+
+    for (const auto &i : qAsConst(sizeEntries)) {
+        QVector<DciEntry> modeEntries;
+        if (i.type != DDciFile::Directory || !readDciEntries(data, i.offset, i.offset + i.size, -1, modeEntries))
+            continue;
+
+        for (const auto &j : qAsConst(modeEntries)) {
+            QVector<DciEntry> scaleEntries;
+            if (j.type != DDciFile::Directory || !readDciEntries(data, j.offset, j.offset + j.size, -1, scaleEntries))
+                continue;
+
+            for (const auto &k : qAsConst(scaleEntries)) {
+                if (k.type == DDciFile::Directory)
+                    variants.append({i.name.toInt(), k.name.toInt(), j.name});
+            }
+        }
+    }
+
+    return true;
+}
+
+// The result of --verify of a dci file
+struct VerifyResult {
+    QString fileName;
+    QStringList errors;
+    int images = 0;
+    int links = 0;
+};
+
+// Check the layout of a dci file written by this tool: "/<size>/<mode>/<scale>/<image>", every
+// "*.light" mode has a "*.dark" sibling, and every link entry (e.g. of recursionLink) is resolved
+// to an image of the file. Only the headers of the webp images are read if "webpHeaders".
+static void verifyDciFile(VerifyResult &result, bool webpHeaders)
+{
+    QFile file(result.fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        result.errors << "can't open the file";
+        return;
+    }
+
+    const qint64 size = file.size();
+    const uchar *data = size > 0 ? file.map(0, size) : nullptr;
+    int fileCount = 0;
+    QVector<DciEntry> sizeEntries;
+    if (!data || !readDciHeader(data, size, &fileCount)) {
+        result.errors << "invalid header";
+        return;
+    }
+    if (!readDciEntries(data, dciHeaderSize, size, fileCount, sizeEntries)) {
+        result.errors << "broken file table";
+        return;
+    }
+    if ((sizeEntries.isEmpty() ? dciHeaderSize : sizeEntries.last().offset + sizeEntries.last().size) != size)
+        result.errors << "unknown data after the files";
+
+    auto readChildren = [&](const DciEntry &entry, const QByteArray &path, QVector<DciEntry> &children) {
+        if (readDciEntries(data, entry.offset, entry.offset + entry.size, -1, children))
+            return true;
+        result.errors << "broken directory " + QString::fromUtf8(path);
+        return false;
+    };
+    auto isNumber = [](const DciEntry &entry, int *number) {
+        bool ok = false;
+        *number = entry.name.toInt(&ok);
+        return entry.type == DDciFile::Directory && ok && *number > 0;
+    };
+
+    // The path of every image and link -> the entry, to resolve the links
+    QHash<QByteArray, DciEntry> images;
+    QVector<QByteArray> links;
+    for (const auto &i : qAsConst(sizeEntries)) {
+        const QByteArray sizePath = '/' + i.name;
+        QVector<DciEntry> modeEntries;
+        int iconSize = 0;
+        if (!isNumber(i, &iconSize)) {
+            result.errors << "unknown entry " + QString::fromUtf8(sizePath);
+            continue;
+        }
+        if (!readChildren(i, sizePath, modeEntries))
+            continue;
+
+        QSet<QByteArray> modes;
+        for (const auto &j : qAsConst(modeEntries))
+            modes.insert(j.name);
+        for (const auto &j : qAsConst(modeEntries)) {
+            const QByteArray modePath = sizePath + '/' + j.name;
+            QVector<DciEntry> scaleEntries;
+            if (j.type != DDciFile::Directory || !(j.name.endsWith(".light") || j.name.endsWith(".dark"))) {
+                result.errors << "unknown entry " + QString::fromUtf8(modePath);
+                continue;
+            }
+            if (j.name.endsWith(".light") && !modes.contains(j.name.left(j.name.size() - 5) + "dark"))
+                result.errors << "no dark mode of " + QString::fromUtf8(modePath);
+            if (!readChildren(j, modePath, scaleEntries))
+                continue;
+            if (scaleEntries.isEmpty())
+                result.errors << "no image in " + QString::fromUtf8(modePath);
+
+            for (const auto &k : qAsConst(scaleEntries)) {
+                const QByteArray scalePath = modePath + '/' + k.name;
+                QVector<DciEntry> imageEntries;
+                int scale = 0;
+                if (!isNumber(k, &scale)) {
+                    result.errors << "unknown entry " + QString::fromUtf8(scalePath);
+                    continue;
+                }
+                if (!readChildren(k, scalePath, imageEntries))
+                    continue;
+                if (imageEntries.isEmpty())
+                    result.errors << "no image in " + QString::fromUtf8(scalePath);
+
+                for (const auto &l : qAsConst(imageEntries)) {
+                    const QByteArray imagePath = scalePath + '/' + l.name;
+                    images.insert(imagePath, l);
+                    if (l.type == DDciFile::Symlink) {
+                        links << imagePath;
+                        continue;
+                    } else if (l.type != DDciFile::File) {
+                        result.errors << "unknown entry " + QString::fromUtf8(imagePath);
+                        continue;
+                    }
+
+                    ++result.images;
+                    if (!webpHeaders || !l.name.endsWith(".webp"))
+                        continue;
+
+                    // WebPGetInfo only parses the headers of the image
+                    int width = 0, height = 0;
+                    if (!WebPGetInfo(data + l.offset, static_cast<size_t>(l.size), &width, &height)) {
+                        result.errors << "invalid webp image " + QString::fromUtf8(imagePath);
+                    } else if (width != iconSize * scale || height != iconSize * scale) {
+                        result.errors << QString("%1 is %2x%3").arg(QString::fromUtf8(imagePath)).arg(width).arg(height);
+                    }
+                }
+            }
+        }
+    }
+
+    for (const auto &i : qAsConst(links)) {
+        // A link may target the other link, limit the depth for the loops
+        QByteArray path = i;
+        auto it = images.constFind(path);
+        for (int depth = 0; it != images.constEnd() && it->type == DDciFile::Symlink && depth < 8; ++depth) {
+            const QByteArray target(reinterpret_cast<const char *>(data + it->offset), static_cast<int>(it->size));
+            path = target.startsWith('/') ? target : path.left(path.lastIndexOf('/') + 1) + target;
+            path = QDir::cleanPath(QString::fromUtf8(path)).toUtf8();
+            it = images.constFind(path);
+        }
+
+        ++result.links;
+        if (it == images.constEnd() || it->type != DDciFile::File)
+            result.errors << QString("broken link %1 -> %2").arg(QString::fromUtf8(i), QString::fromUtf8(path));
+    }
+}
+
+// Verify the dci files of the directory in parallel, and resolve the symlinks to them
+static bool verifyOutputDirectory(const QString &directory, bool webpHeaders, int jobs)
+{
+    const QDir dir(directory);
+    if (!dir.exists()) {
+        qWarning() << "The directory is not exists:" << directory;
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QVector<VerifyResult> results;
+    QStringList brokenSymlinks;
+    int symlinks = 0;
+    const auto files = dir.entryInfoList({"*.dci"}, QDir::Files | QDir::System | QDir::NoDotAndDotDot, QDir::Name);
+    for (const auto &i : files) {
+        if (!i.isSymLink()) {
+            results.append({i.absoluteFilePath()});
+            continue;
+        }
+
+        // The chain of the symlinks (e.g. an alias of a --dedup icon) must end at a dci file
+        ++symlinks;
+        const QString target = i.canonicalFilePath();
+        if (target.isEmpty() || !QFileInfo(target).isFile() || !target.endsWith(".dci"))
+            brokenSymlinks << QString("%1 -> %2").arg(i.fileName(), i.symLinkTarget());
+    }
+
+    auto verify = [webpHeaders](VerifyResult &result) {
+        verifyDciFile(result, webpHeaders);
+    };
+    if (jobs > 1) {
+        QtConcurrent::blockingMap(results, verify);
+    } else {
+        for (auto &result : results)
+            verify(result);
+    }
+
+    int brokenFiles = 0, images = 0, links = 0;
+    for (const auto &result : qAsConst(results)) {
+        images += result.images;
+        links += result.links;
+        if (result.errors.isEmpty())
+            continue;
+        ++brokenFiles;
+        qWarning().noquote() << QString("%1: %2").arg(result.fileName, result.errors.join(", "));
+    }
+    if (!brokenSymlinks.isEmpty())
+        qWarning() << "Broken symlinks:" << brokenSymlinks;
+
+    const qint64 elapsed = qMax<qint64>(1, timer.elapsed());
+    qInfo().noquote() << QString("Verified %1 dci files (%2 images, %3 links) and %4 symlinks in %5 ms, %6 files/s")
+                         .arg(results.size()).arg(images).arg(links).arg(symlinks).arg(elapsed)
+                         .arg((results.size() + symlinks) * 1000 / elapsed);
+    qInfo().noquote() << QString("Broken dci files: %1, broken symlinks: %2").arg(brokenFiles).arg(brokenSymlinks.size());
+    return brokenFiles == 0 && brokenSymlinks.isEmpty();
+}
+
+// The same hash function of the icon-theme.cache of GTK, it reads the name
+// as signed chars, so the bytes of the UTF-8 names are sign extended.
+static quint32 iconNameHash(const QByteArray &name)
+{
+    quint32 hash = 0;
+    for (const char ch : name)
+        hash = (hash << 5) - hash + static_cast<quint32>(static_cast<qint32>(static_cast<signed char>(ch)));
+    return hash;
+}
+
+// The layout of the --index file in the output directory, all of the numbers are little endian:
+//  header: magic "DCIINDX\0" (8 bytes), version (4 bytes), bucket count (4 bytes), entry count (4 bytes),
+//          variant count (4 bytes), offset of the entries (4 bytes), offset of the variants (4 bytes),
+//          offset of the strings (4 bytes), reserved (4 bytes)
+//  buckets: the first entry of the iconNameHash(name) % bucket count (4 bytes), 0xffffffff is empty
+//  entry: hash (4 bytes), the next entry of the bucket (4 bytes), offset and size of the icon name
+//         (4 + 4 bytes), offset and size of the resolved dci file name (4 + 4 bytes),
+//         the first variant (4 bytes), variant count (4 bytes)
+//  variant: size (2 bytes), scale (1 byte), reserved (1 byte), offset of the mode name (4 bytes)
+//  strings: the UTF-8 names, every name ends with '\0'
+static const QString lookupIndexFileName = QStringLiteral("dci-icon-theme.index");
+static const int indexHeaderSize = 40;
+static const int indexEntrySize = 32;
+static const int indexVariantSize = 8;
+static const quint32 indexEmptyBucket = 0xffffffff;
+
+static bool writeLookupIndex(const QDir &outputDir)
+{
+    struct IndexEntry {
+        QByteArray name;
+        QByteArray fileName;
+        quint32 hash;
+    };
+
+    QVector<IndexEntry> entries;
+    QHash<QByteArray, QVector<IconVariant>> fileVariants; // the resolved file name -> variants
+    const auto files = outputDir.entryInfoList({"*.dci"}, QDir::Files | QDir::System | QDir::NoDotAndDotDot, QDir::Name);
+    for (const auto &i : files) {
+        // Resolve the symlink chains of the aliases
+        const QFileInfo target(i.isSymLink() ? i.canonicalFilePath() : i.absoluteFilePath());
+        if (!target.exists() || target.dir() != outputDir) {
+            qWarning() << "Ignore the broken symlink:" << i.filePath();
+            continue;
+        }
+
+        const QByteArray fileName = target.fileName().toUtf8();
+        if (!fileVariants.contains(fileName)) {
+            QVector<IconVariant> variants;
+            if (!readIconVariants(target.absoluteFilePath(), variants)) {
+                qWarning() << "Skip invalid dci file:" << target.absoluteFilePath();
+                continue;
+            }
+            fileVariants.insert(fileName, variants);
+        }
+
+        const QByteArray name = i.completeBaseName().toUtf8();
+        entries.append({name, fileName, iconNameHash(name)});
+    }
+
+    QByteArray strings;
+    QHash<QByteArray, quint32> stringOffsets;
+    auto stringOffset = [&](const QByteArray &string) {
+        auto it = stringOffsets.constFind(string);
+        if (it != stringOffsets.constEnd())
+            return *it;
+        const quint32 offset = static_cast<quint32>(strings.size());
+        strings += string;
+        strings += '\0';
+        stringOffsets.insert(string, offset);
+        return offset;
+    };
+
+    const quint32 bucketCount = qMax<quint32>(1, static_cast<quint32>(entries.size()));
+    QVector<quint32> buckets(static_cast<int>(bucketCount), indexEmptyBucket);
+    QByteArray entryData(entries.size() * indexEntrySize, '\0');
+    QByteArray variantData;
+    QHash<QByteArray, QPair<quint32, quint32>> fileVariantRanges;
+
+    for (int i = 0; i < entries.size(); ++i) {
+        const IndexEntry &entry = entries.at(i);
+        auto range = fileVariantRanges.constFind(entry.fileName);
+        if (range == fileVariantRanges.constEnd()) {
+            const auto &variants = fileVariants[entry.fileName];
+            const quint32 first = static_cast<quint32>(variantData.size() / indexVariantSize);
+            for (const auto &v : variants) {
+                char data[indexVariantSize] = {};
+                qToLittleEndian<quint16>(static_cast<quint16>(v.size), data);
+                data[2] = static_cast<char>(v.scale);
+                qToLittleEndian<quint32>(stringOffset(v.mode), data + 4);
+                variantData.append(data, indexVariantSize);
+            }
+            range = fileVariantRanges.insert(entry.fileName, {first, static_cast<quint32>(variants.size())});
+        }
+
+        // Insert to the head of the bucket chain
+        const quint32 bucket = entry.hash % bucketCount;
+        char *data = entryData.data() + i * indexEntrySize;
+        qToLittleEndian<quint32>(entry.hash, data);
+        qToLittleEndian<quint32>(buckets.at(static_cast<int>(bucket)), data + 4);
+        qToLittleEndian<quint32>(stringOffset(entry.name), data + 8);
+        qToLittleEndian<quint32>(static_cast<quint32>(entry.name.size()), data + 12);
+        qToLittleEndian<quint32>(stringOffset(entry.fileName), data + 16);
+        qToLittleEndian<quint32>(static_cast<quint32>(entry.fileName.size()), data + 20);
+        qToLittleEndian<quint32>(range->first, data + 24);
+        qToLittleEndian<quint32>(range->second, data + 28);
+        buckets[static_cast<int>(bucket)] = static_cast<quint32>(i);
+    }
+
+    QByteArray bucketData(static_cast<int>(bucketCount) * 4, '\0');
+    for (int i = 0; i < buckets.size(); ++i)
+        qToLittleEndian<quint32>(buckets.at(i), bucketData.data() + i * 4);
+
+    const quint32 entriesOffset = indexHeaderSize + static_cast<quint32>(bucketData.size());
+    const quint32 variantsOffset = entriesOffset + static_cast<quint32>(entryData.size());
+    const quint32 stringsOffset = variantsOffset + static_cast<quint32>(variantData.size());
+
+    QByteArray header(indexHeaderSize, '\0');
+    memcpy(header.data(), "DCIINDX\0", 8);
+    qToLittleEndian<quint32>(1, header.data() + 8);
+    qToLittleEndian<quint32>(bucketCount, header.data() + 12);
+    qToLittleEndian<quint32>(static_cast<quint32>(entries.size()), header.data() + 16);
+    qToLittleEndian<quint32>(static_cast<quint32>(variantData.size() / indexVariantSize), header.data() + 20);
+    qToLittleEndian<quint32>(entriesOffset, header.data() + 24);
+    qToLittleEndian<quint32>(variantsOffset, header.data() + 28);
+    qToLittleEndian<quint32>(stringsOffset, header.data() + 32);
+
+    QSaveFile file(outputDir.absoluteFilePath(lookupIndexFileName));
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(header);
+    file.write(bucketData);
+    file.write(entryData);
+    file.write(variantData);
+    file.write(strings);
+
+    qInfo() << "Indexed" << entries.size() << "icon names of" << fileVariants.size() << "dci files";
+    return file.commit();
+}
+
+// Copy by a reflink if the file system supports, or else by copy_file_range in the kernel
+static bool copyFileFast(const QString &from, const QString &to)
+{
+    const int in = open(QFile::encodeName(from).constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return false;
+
+    const int out = open(QFile::encodeName(to).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    struct stat st;
+    if (!ok && fstat(in, &st) == 0) {
+        off_t remaining = st.st_size;
+        while (remaining > 0) {
+            const ssize_t copied = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(remaining), 0);
+            if (copied <= 0)
+                break;
+            remaining -= copied;
+        }
+        ok = remaining == 0;
+    }
+
+    close(in);
+    close(out);
+    if (!ok) {
+        // e.g. copy_file_range is not supported by the file system
+        QFile::remove(to);
+        return QFile::copy(from, to);
+    }
+
+    return true;
+}
+
+static bool doFixDarkTheme(const QFileInfo &file, const QString &newFile)
+{
+    const QString tempFile = temporaryFilePath(newFile);
+    QFile::remove(tempFile);
+
+    switch (darkThemeState(file.absoluteFilePath())) {
+    case InvalidDciFile:
+        qWarning() << "Skip invalid dci file:" << file.absoluteFilePath();
+        return false;
+    case DarkThemeComplete:
+        // Nothing to fix, don't decode and serialize the file again
+        dciChecker(copyFileFast(file.absoluteFilePath(), tempFile) && commitTemporaryFile(newFile));
+        return true;
+    case DarkThemeMissing:
+        break;
+    }
+
+    // The new "*.dark" directories are inside the size directories, it's not
+    // possible to append them to the file, so rewrite the whole dci file.
+    DDciFile dciFile(file.absoluteFilePath());
+    if (!dciFile.isValid()) {
+        qWarning() << "Skip invalid dci file:" << file.absoluteFilePath();
+        return false;
+    }
+
+    for (const auto &i : dciFile.list("/")) {
+        if (dciFile.type(i) != DDciFile::Directory)
+            continue;
+
+        for (const auto &j : dciFile.list(i)) {
+            if (dciFile.type(j) != DDciFile::Directory || !j.endsWith(".light"))
+                continue;
+
+            const QString darkDir(j.left(j.size() - 5) + "dark");
+            Q_ASSERT(darkDir.endsWith(".dark"));
+            if (!dciFile.exists(darkDir)) {
+                dciChecker(dciFile.mkdir(darkDir));
+                dciChecker(recursionLink(dciFile, j, darkDir));
+            }
+        }
     }
+
+    dciChecker(!dciFailed && dciFile.writeToFile(tempFile) && commitTemporaryFile(newFile));
+    return true;
 }
 
-static inline QByteArray webpImageData(const QImage &image, int quality) {
-    QByteArray data;
-    QBuffer buffer(&data);
-    bool ok = buffer.open(QIODevice::WriteOnly);
-    Q_ASSERT(ok);
-    dciChecker(image.save(&buffer, "webp", quality));
-    return data;
+// Nearest-rank percentile of the sorted values
+static qint64 percentile(const QVector<qint64> &sortedValues, double p)
+{
+    if (sortedValues.isEmpty())
+        return 0;
+
+    const int rank = qCeil(p * sortedValues.size());
+    return sortedValues.at(qBound(0, rank - 1, sortedValues.size() - 1));
 }
 
-static bool writeScaledImage(DDciFile &dci, const QString &imageFile, const QString &targetDir, int scale/* = 2*/)
+static bool reportStats(const QVector<IconTask> &tasks, qint64 traversalTime, qint64 linkTime,
+                        bool print, const QString &jsonFile)
 {
-    int size = scale * 256;
-    QImageReader image(imageFile);
-    if (!image.canRead()) {
-        qWarning() << "Ignore the null image file:" << imageFile;
-        return false;
+    static const int slowestCount = 10;
+    struct Stage {
+        const char *name;
+        qint64 IconStats::*time;
+    };
+    static const Stage stages[] = {
+        { "decode", &IconStats::decode },
+        { "scale", &IconStats::scale },
+        { "encode", &IconStats::encode },
+        { "write", &IconStats::write },
+    };
+
+    QVector<const IconTask *> converted;
+    qint64 bytesIn = 0, bytesOut = 0;
+    QMap<QString, int> presets;
+    for (const auto &task : tasks) {
+        if (!task.written || task.upToDate || task.duplicateOf)
+            continue;
+        converted << &task;
+        bytesIn += task.stats.bytesIn;
+        bytesOut += task.stats.bytesOut;
+        if (task.stats.preset)
+            ++presets[task.stats.preset];
     }
 
-    if (image.supportsOption(QImageIOHandler::ScaledSize)) {
-        image.setScaledSize(QSize(size, size));
+    auto ms = [](qint64 nsecs) {
+        return nsecs / 1e6;
+    };
+
+    QJsonObject stageObjects {
+        {"traversal", QJsonObject {{"total_ms", ms(traversalTime)}}},
+        {"link", QJsonObject {{"total_ms", ms(linkTime)}}},
+    };
+    if (print) {
+        qInfo().noquote() << QString("Converted %1 icons, %2 bytes in, %3 bytes out")
+                             .arg(converted.size()).arg(bytesIn).arg(bytesOut);
+        qInfo().noquote() << QString("%1 total %2 ms").arg(QString("traversal"), -10).arg(ms(traversalTime), 0, 'f', 1);
     }
 
-    dciChecker(dci.mkdir(targetDir + QString("/%1").arg(scale)));
-    const QImage &img = image.read().scaledToWidth(size, Qt::SmoothTransformation);
-    const QByteArray &data = webpImageData(img, 100);
-    dciChecker(dci.writeFile(targetDir + QString("/%1/1.webp").arg(scale), data));
+    for (const auto &stage : stages) {
+        QVector<qint64> values;
+        values.reserve(converted.size());
+        qint64 total = 0;
+        for (const auto task : qAsConst(converted)) {
+            values << task->stats.*stage.time;
+            total += task->stats.*stage.time;
+        }
+        std::sort(values.begin(), values.end());
 
-    return true;
+        stageObjects.insert(stage.name, QJsonObject {
+                                {"count", values.size()},
+                                {"total_ms", ms(total)},
+                                {"p50_ms", ms(percentile(values, 0.5))},
+                                {"p99_ms", ms(percentile(values, 0.99))},
+                            });
+        if (print) {
+            qInfo().noquote() << QString("%1 total %2 ms, p50 %3 ms, p99 %4 ms")
+                                 .arg(QString(stage.name), -10).arg(ms(total), 0, 'f', 1)
+                                 .arg(ms(percentile(values, 0.5)), 0, 'f', 2)
+                                 .arg(ms(percentile(values, 0.99)), 0, 'f', 2);
+        }
+    }
+
+    if (print)
+        qInfo().noquote() << QString("%1 total %2 ms").arg(QString("link"), -10).arg(ms(linkTime), 0, 'f', 1);
+
+    // The presets of --auto-encode
+    QJsonObject presetObject;
+    for (auto i = presets.constBegin(); i != presets.constEnd(); ++i) {
+        presetObject.insert(i.key(), i.value());
+        if (print)
+            qInfo().noquote() << QString("%1 %2 icons").arg(i.key(), -14).arg(i.value());
+    }
+
+    std::sort(converted.begin(), converted.end(), [](const IconTask *t1, const IconTask *t2) {
+        return t1->stats.total() > t2->stats.total();
+    });
+    QJsonArray slowest;
+    for (int i = 0; i < qMin(slowestCount, converted.size()); ++i) {
+        const IconTask *task = converted.at(i);
+        QJsonObject icon {
+            {"file", task->file.filePath()},
+            {"total_ms", ms(task->stats.total())},
+        };
+        if (task->stats.preset)
+            icon.insert("preset", task->stats.preset);
+        slowest.append(icon);
+        if (print) {
+            qInfo().noquote() << QString("Slow icon %1 ms: %2%3")
+                                 .arg(ms(task->stats.total()), 0, 'f', 1).arg(task->file.filePath())
+                                 .arg(task->stats.preset ? QString(" (%1)").arg(task->stats.preset) : QString());
+        }
+    }
+
+    if (jsonFile.isEmpty())
+        return true;
+
+    QJsonObject root {
+        {"icons", converted.size()},
+        {"bytes_in", QString::number(bytesIn)},
+        {"bytes_out", QString::number(bytesOut)},
+        {"stages", stageObjects},
+        {"slowest", slowest},
+    };
+    if (!presetObject.isEmpty())
+        root.insert("presets", presetObject);
+    QSaveFile file(jsonFile);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(QJsonDocument(root).toJson());
+    return file.commit();
 }
 
-static bool writeImage(DDciFile &dci, const QString &imageFile, const QString &targetDir)
+struct BenchmarkStage {
+    const char *name;
+    int count = 0;
+    qint64 bytes = 0;
+    qint64 nsecs = 0;
+    long peakRss = 0;
+};
+
+// Reset the peak resident set size of the process to the current size, so the peak
+// of a stage doesn't include the former stages, it needs Linux 4.0 or later.
+static void resetPeakRss()
 {
-    return writeScaledImage(dci, imageFile, targetDir, 2) &&
-            writeScaledImage(dci, imageFile, targetDir, 3);
+    const int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    static bool warned = false;
+    if (::write(fd, "5", 1) != 1 && !warned) {
+        warned = true;
+        qWarning() << "Failed on reset the peak RSS, the peaks of the stages include the former stages";
+    }
+    close(fd);
 }
 
-static bool recursionLink(DDciFile &dci, const QString &fromDir, const QString &targetDir)
+// The peak resident set size of the process in KiB since the last resetPeakRss
+static long peakRss()
 {
-    for (const auto &i : dci.list(fromDir, true)) {
-        const QString file(fromDir + "/" + i);
-        const QString targetFile(targetDir + "/" + i);
-        if (dci.type(file) == DDciFile::Directory) {
-            if (!dci.mkdir(targetFile))
-                return false;
-            if (!recursionLink(dci, file, targetFile))
-                return false;
-        } else {
-            if (!dci.link(file, targetFile))
-                return false;
+    QFile file(QStringLiteral("/proc/self/status"));
+    if (file.open(QIODevice::ReadOnly)) {
+        for (const auto &line : file.readAll().split('\n')) {
+            if (line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toLong();
         }
     }
 
-    return true;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
 }
 
-static QByteArray readNextSection(QIODevice *io) {
-    QByteArray section;
-    char ch;
+static QImage makeBenchmarkImage(int size, bool alpha, bool dark)
+{
+    QImage image(size, size, QImage::Format_ARGB32_Premultiplied);
+    image.fill(alpha ? Qt::transparent : (dark ? QColor(30, 30, 30) : QColor(240, 240, 240)));
 
-    bool oneLine = true;
-    while (io->getChar(&ch)) {
-        if (!oneLine && ch == '"') { // ["] end
-            if (io->peek(1) == ",")
-                io->skip(1); // skip [,]
-            break;
-        }  else if (ch == ',') {
-            break;
-        } else if (ch == '"') { // ["] begin
-            oneLine = false;
-            continue;
+    QPainter pa(&image);
+    pa.setRenderHint(QPainter::Antialiasing);
+    QRadialGradient gradient(size / 2.0, size / 2.0, size / 2.0);
+    gradient.setColorAt(0, dark ? QColor(20, 90, 200) : QColor(80, 180, 255));
+    gradient.setColorAt(1, dark ? QColor(10, 30, 80, alpha ? 0 : 255) : QColor(0, 90, 200, alpha ? 0 : 255));
+    pa.setBrush(gradient);
+    pa.setPen(QPen(dark ? Qt::white : Qt::black, size / 32.0));
+    pa.drawEllipse(QRectF(size * 0.1, size * 0.1, size * 0.8, size * 0.8));
+    pa.drawLine(QPointF(size * 0.3, size * 0.5), QPointF(size * 0.7, size * 0.5));
+    pa.end();
+
+    return image;
+}
+
+static void printBenchmarkStage(const BenchmarkStage &stage)
+{
+    const double secs = qMax<qint64>(stage.nsecs, 1) / 1e9;
+    qInfo().noquote() << QString("%1 %2 items, %3 ms, %4 items/s, %5 MiB/s, peak RSS %6 MiB")
+                         .arg(QString(stage.name), -16)
+                         .arg(stage.count, 6)
+                         .arg(stage.nsecs / 1e6, 10, 'f', 1)
+                         .arg(stage.count / secs, 10, 'f', 1)
+                         .arg(stage.bytes / secs / 1048576.0, 8, 'f', 2)
+                         .arg(stage.peakRss / 1024.0, 0, 'f', 1);
+}
+
+// Measure the stages of the conversion on a synthetic corpus, the corpus contains the
+// different source sizes, icons with or without alpha, and the light/dark icon pairs.
+static int runBenchmark(const ConvertOptions &options, int count, int jobs)
+{
+    QTemporaryDir workDir;
+    if (!workDir.isValid()) {
+        qWarning() << "Failed on create the benchmark directory" << workDir.errorString();
+        return -5;
+    }
+
+    const QDir dir(workDir.path());
+    dciChecker(dir.mkpath("source/dark") && dir.mkpath("output") && dir.mkpath("fixed"));
+
+    static const int sourceSizes[] = { 64, 256, 1024 };
+    QStringList sourceFiles;
+    qint64 sourceBytes = 0;
+    for (int i = 0; i < count; ++i) {
+        const int size = sourceSizes[i % 3];
+        const bool alpha = i % 2;
+        const bool hasDark = i % 4 < 2;
+        const QString fileName = QString("icon-%1.png").arg(i);
+
+        const QString file = dir.absoluteFilePath("source/" + fileName);
+        dciChecker(makeBenchmarkImage(size, alpha, false).save(file));
+        sourceFiles << file;
+        sourceBytes += QFileInfo(file).size();
+        if (hasDark)
+            dciChecker(makeBenchmarkImage(size, alpha, true).save(dir.absoluteFilePath("source/dark/" + fileName)));
+    }
+    qInfo() << "Benchmark corpus:" << count << "icons," << sourceBytes << "bytes of the light icons";
+
+    BenchmarkStage decode { "decode" }, scale { "scale" }, encode { "webp encode" },
+            write { "dci write" }, convert { "convert" }, csv { "csv parse" }, fixDark { "fix dark theme" };
+    QElapsedTimer timer;
+
+    // The stages of convertIcons, measured one by one
+    for (const auto &file : qAsConst(sourceFiles)) {
+        const QFileInfo info(file);
+        const QFileInfo darkInfo(darkIconFile(info));
+        DDciFile dciFile;
+
+        for (const auto &mode : { QStringLiteral("normal.light"), QStringLiteral("normal.dark") }) {
+            const QFileInfo &source = mode == QLatin1String("normal.light") ? info : darkInfo;
+            if (!source.exists())
+                continue;
+
+            QByteArray data;
+            dciChecker(readFileData(source.filePath(), data));
+            resetPeakRss();
+            timer.start();
+            const QImage image = readImage(data, source.filePath(), options.maxImageSize());
+            decode.nsecs += timer.nsecsElapsed();
+            decode.bytes += data.size();
+            ++decode.count;
+            decode.peakRss = qMax(decode.peakRss, peakRss());
+
+            for (int size : options.sizes) {
+                if (!dciFile.exists(QString("/%1").arg(size)))
+                    dciChecker(dciFile.mkdir(QString("/%1").arg(size)));
+                dciChecker(dciFile.mkdir(QString("/%1/%2").arg(size).arg(mode)));
+                for (int s : options.scales) {
+                    resetPeakRss();
+                    timer.start();
+                    const QImage scaled = scaledImage(image, s * size);
+                    scale.nsecs += timer.nsecsElapsed();
+                    scale.bytes += scaled.sizeInBytes();
+                    ++scale.count;
+                    scale.peakRss = qMax(scale.peakRss, peakRss());
+
+                    resetPeakRss();
+                    timer.start();
+                    const QByteArray data = webpImageData(scaled, options.webp);
+                    encode.nsecs += timer.nsecsElapsed();
+                    encode.bytes += data.size();
+                    ++encode.count;
+                    encode.peakRss = qMax(encode.peakRss, peakRss());
+
+                    dciChecker(dciFile.mkdir(QString("/%1/%2/%3").arg(size).arg(mode).arg(s)));
+                    dciChecker(dciFile.writeFile(QString("/%1/%2/%3/1.webp").arg(size).arg(mode).arg(s), data));
+                }
+            }
         }
 
-        section.append(ch);
+        const QString dciFilePath = dir.absoluteFilePath("output/" + info.completeBaseName() + ".dci");
+        resetPeakRss();
+        timer.start();
+        dciChecker(dciFile.writeToFile(dciFilePath));
+        write.nsecs += timer.nsecsElapsed();
+        write.bytes += QFileInfo(dciFilePath).size();
+        ++write.count;
+        write.peakRss = qMax(write.peakRss, peakRss());
+    }
+
+    // The whole pipeline of convertIcons, like the normal mode
+    QVector<IconTask> tasks;
+    for (const auto &file : qAsConst(sourceFiles)) {
+        const QFileInfo info(file);
+        tasks.append({info, dir.absoluteFilePath("fixed/" + info.completeBaseName() + ".dci")});
+    }
+    resetPeakRss();
+    timer.start();
+    convertIcons(tasks, options, jobs);
+    convert.nsecs = timer.nsecsElapsed();
+    convert.count = tasks.size();
+    convert.bytes = sourceBytes;
+    convert.peakRss = peakRss();
+    for (const auto &task : qAsConst(tasks))
+        QFile::remove(task.dciFilePath);
 
-        if(oneLine && io->peek(1) == "\n")
-            break;
+    // Every icon have 10 aliases, and a half of them use the multi-line field
+    const QString csvFile = dir.absoluteFilePath("symlink.csv");
+    {
+        QFile file(csvFile);
+        dciChecker(file.open(QIODevice::WriteOnly));
+        for (int i = 0; i < count; ++i) {
+            QByteArray line = "icon-" + QByteArray::number(i) + ", ";
+            if (i % 2) {
+                line += "\"";
+                for (int j = 0; j < 10; ++j)
+                    line += "\nalias-" + QByteArray::number(i) + "-" + QByteArray::number(j);
+                line += "\n\"\n";
+            } else {
+                line += "alias-" + QByteArray::number(i) + "\n";
+            }
+            file.write(line);
+        }
+    }
+    resetPeakRss();
+    timer.start();
+    bool csvOk = false;
+    const SymlinkMap map = parseIconFileSymlinkMap(csvFile, &csvOk);
+    dciChecker(csvOk);
+    csv.nsecs = timer.nsecsElapsed();
+    csv.count = map.size();
+    csv.bytes = QFileInfo(csvFile).size();
+    csv.peakRss = peakRss();
+
+    // The light only dci files of the write stage need to fix
+    for (const auto &file : qAsConst(sourceFiles)) {
+        const QString baseName = QFileInfo(file).completeBaseName() + ".dci";
+        const QFileInfo dciFile(dir.absoluteFilePath("output/" + baseName));
+        resetPeakRss();
+        timer.start();
+        doFixDarkTheme(dciFile, dir.absoluteFilePath("fixed/" + baseName));
+        fixDark.nsecs += timer.nsecsElapsed();
+        fixDark.bytes += dciFile.size();
+        ++fixDark.count;
+        fixDark.peakRss = qMax(fixDark.peakRss, peakRss());
     }
 
-    return section.trimmed();
+    for (const auto &stage : { decode, scale, encode, write, convert, csv, fixDark })
+        printBenchmarkStage(stage);
+
+    return 0;
 }
 
-QMultiHash<QString, QString> parseIconFileSymlinkMap(const QString &csvFile) {
-    QFile file(csvFile);
-    if (!file.open(QIODevice::ReadOnly)) {
-        qWarning() << "Failed on open symlink map file:" << csvFile;
-        exit(-7);
+// The icons that are not converted by the build, they're counted for --dry-run
+struct SkippedFiles {
+    int darkFiles = 0;
+    int existsFiles = 0;
+    int sourceSymlinks = 0;
+};
+
+// The light and dark sources of an icon of the --dry-run, only the image headers are read
+struct PlannedIcon {
+    const IconTask *task;
+    QSize lightSize;
+    qint64 lightBytes = 0;
+    bool hasDark = false;
+    QSize darkSize;
+    qint64 darkBytes = 0;
+};
+
+// Estimate the encoded size of an image by the bytes per pixel of the source,
+// the webp sources of the pixel size are copied, and the SVG sources have no
+// meaningful pixel size, assume 1 byte per pixel for them.
+static qint64 estimateEncodedBytes(const QString &fileName, const QSize &sourceSize, qint64 sourceBytes, int pixelSize)
+{
+    const qint64 pixels = qint64(pixelSize) * pixelSize;
+    if (sourceSize == QSize(pixelSize, pixelSize) && QFileInfo(fileName).suffix().toLower() == QLatin1String("webp"))
+        return sourceBytes;
+    if (isSvgFile(fileName) || sourceSize.isEmpty())
+        return pixels;
+
+    const double bytesPerPixel = qMin(4.0, double(sourceBytes) / (qint64(sourceSize.width()) * sourceSize.height()));
+    return qRound64(pixels * bytesPerPixel);
+}
+
+static void printBuildPlan(const QVector<IconTask> &tasks, const QVector<IconTask> &fixTasks, const SkippedFiles &skipped,
+                           const SymlinkMap &symlinksMap, const ConvertOptions &options, int jobs)
+{
+    QVector<PlannedIcon> icons;
+    int upToDate = 0, aliases = 0;
+    for (const auto &task : tasks) {
+        aliases += symlinksMap.names(task.file.completeBaseName()).size();
+        if (task.upToDate)
+            ++upToDate;
+        else
+            icons.append({&task});
     }
 
-    QMultiHash<QString, QString> map;
-    while (!file.atEnd()) {
-        QByteArray key = readNextSection(&file);
-        QByteArray value = readNextSection(&file);
-        for (const auto &i : value.split('\n')) {
-            map.insert(QString::fromLocal8Bit(key), QString::fromLocal8Bit(i));
+    auto readHeaders = [](PlannedIcon &icon) {
+        icon.lightSize = QImageReader(icon.task->file.filePath()).size();
+        icon.lightBytes = icon.task->file.size();
+        const QFileInfo dark(darkIconFile(icon.task->file));
+        icon.hasDark = dark.exists();
+        if (icon.hasDark) {
+            icon.darkSize = QImageReader(dark.filePath()).size();
+            icon.darkBytes = dark.size();
         }
+    };
+    if (jobs > 1) {
+        QtConcurrent::blockingMap(icons, readHeaders);
+    } else {
+        for (auto &icon : icons)
+            readHeaders(icon);
+    }
 
-        char ch = 0;
-        while (file.getChar(&ch) && ch != '\n');
+    int darkIcons = 0, unreadable = 0;
+    QMap<int, qint64> sizeBytes;
+    qint64 totalBytes = 0;
+    for (const auto &icon : qAsConst(icons)) {
+        if (!icon.lightSize.isValid())
+            ++unreadable;
+        if (icon.hasDark)
+            ++darkIcons;
+
+        const QString darkFile = darkIconFile(icon.task->file);
+        for (int size : options.sizes) {
+            qint64 bytes = 0;
+            for (int scale : options.scales) {
+                bytes += estimateEncodedBytes(icon.task->file.filePath(), icon.lightSize, icon.lightBytes, size * scale);
+                if (icon.hasDark)
+                    bytes += estimateEncodedBytes(darkFile, icon.darkSize, icon.darkBytes, size * scale);
+            }
+            sizeBytes[size] += bytes;
+            totalBytes += bytes;
+        }
     }
 
-    qInfo() << "Got symlinks:" << map.size();
+    qInfo().noquote() << QString("Convert %1 icons, %2 of them have the dark icons, %3 can't be read")
+                         .arg(icons.size()).arg(darkIcons).arg(unreadable);
+    if (upToDate > 0)
+        qInfo().noquote() << QString("Keep %1 up to date icons of the incremental build").arg(upToDate);
+    if (!fixTasks.isEmpty())
+        qInfo().noquote() << QString("Fix the dark theme of %1 dci files").arg(fixTasks.size());
+    qInfo().noquote() << QString("Skip %1 dark icon files, %2 exists dci files, %3 symlinks of the sources")
+                         .arg(skipped.darkFiles).arg(skipped.existsFiles).arg(skipped.sourceSymlinks);
+    qInfo().noquote() << QString("Link %1 symlinks of the %2 names in the symlink map")
+                         .arg(aliases).arg(symlinksMap.size());
+    for (auto i = sizeBytes.constBegin(); i != sizeBytes.constEnd(); ++i) {
+        qInfo().noquote() << QString("%1 %2 images, estimated %3 KiB")
+                             .arg(QString("size %1").arg(i.key()), -10)
+                             .arg(icons.size() * options.scales.size()).arg(i.value() / 1024);
+    }
+    qInfo().noquote() << QString("Estimated output %1 KiB").arg(totalBytes / 1024);
+}
 
-    return map;
+// The mtime (in nanoseconds) and size of the source files, to find the changed files of --watch
+typedef QHash<QString, QPair<qint64, qint64>> SourceStamps;
+
+static SourceStamps scanSourceStamps(const QStringList &sourceDirectories, const QVector<QRegExp> &nameFilters,
+                                     QStringList &directories)
+{
+    SourceStamps stamps;
+    for (const auto &sd : sourceDirectories) {
+        const QString path = QDir(sd).absolutePath();
+        if (!QFileInfo(path).isDir())
+            continue;
+
+        SourceFiles sourceFiles;
+        scanSourceDirectory(QFile::encodeName(path), nameFilters, sourceFiles);
+        directories << path << sourceFiles.directories;
+        for (const auto &i : qAsConst(sourceFiles.files)) {
+            struct stat st;
+            if (stat(QFile::encodeName(i).constData(), &st) == 0)
+                stamps.insert(i, { qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, qint64(st.st_size) });
+        }
+    }
+
+    return stamps;
 }
 
-void makeLink(const QFileInfo &file, const QDir &outputDir, const QString &dciFilePath,
-              const QMultiHash<QString, QString> &symlinksMap)
+// The state of the build that --watch continues
+struct WatchContext {
+    QStringList sourceDirectories;
+    QVector<QRegExp> nameFilters;
+    QDir outputDir;
+    ConvertOptions options;
+    int jobs = 1;
+    SymlinkMap symlinksMap;
+    // The dci file -> the source file that claims it, the first source wins like the build
+    QHash<QString, QString> outputSources;
+    IconManifest manifest;
+};
+
+// The light sources of the icon name in the order of the build, the first one is the owner of --merge
+static QStringList iconSourcesOfName(const QStringList &sourceDirectories, const SourceStamps &stamps,
+                                     const QString &baseName)
 {
-    if (symlinksMap.contains(file.completeBaseName())) {
-        const QString symlinkKey = QFileInfo(dciFilePath).fileName();
-        for (const auto &symTarget : symlinksMap.values(file.completeBaseName())) {
-            const QString newSymlink = outputDir.absoluteFilePath(symTarget + ".dci");
-            qInfo() << "Create symlink from" << symlinkKey << "to" << newSymlink;
-            if (!QFile::link(symlinkKey, newSymlink)) {
-                qWarning() << "Failed on create symlink from" << symlinkKey << "to" << newSymlink;
-            }
+    QVector<QPair<int, QStringList>> sources;
+    for (auto i = stamps.constBegin(); i != stamps.constEnd(); ++i) {
+        const QFileInfo file(i.key());
+        if (file.completeBaseName() != baseName || file.path().endsWith(QStringLiteral("/dark")))
+            continue;
+
+        int directory = 0;
+        while (directory < sourceDirectories.size()
+               && !i.key().startsWith(QDir(sourceDirectories.at(directory)).absolutePath() + '/')) {
+            ++directory;
         }
+        // Compare the path components like the sorted entries of scanSourceDirectory
+        sources.append({ directory, i.key().split('/') });
     }
+    std::sort(sources.begin(), sources.end());
+
+    QStringList files;
+    for (const auto &i : qAsConst(sources))
+        files << i.second.join('/');
+    return files;
 }
 
-void doFixDarkTheme(const QFileInfo &file, const QDir &outputDir, const QMultiHash<QString, QString> &symlinksMap)
+// Rebuild the dci files and the symlinks of the changed source files, a dark icon
+// file rebuilds its light icon, and a removed icon removes its outputs.
+static void rebuildIcons(WatchContext &context, const QSet<QString> &changedFiles, const SourceStamps &stamps)
 {
-    const QString &newFile = outputDir.absoluteFilePath(file.fileName());
+    QSet<QString> icons;
+    for (const auto &i : changedFiles) {
+        const QFileInfo file(i);
+        if (file.path().endsWith(QStringLiteral("/dark")))
+            icons.insert(QDir::cleanPath(file.path() + "/../" + file.fileName()));
+        else
+            icons.insert(i);
+    }
 
-    DDciFile dciFile(file.absoluteFilePath());
-    if (!dciFile.isValid()) {
-        qWarning() << "Skip invalid dci file:" << file.absoluteFilePath();
-        return;
+    // The --dedup icons linked to the rebuilt or removed icons are rebuilt too
+    QSet<QString> outputs;
+    for (const auto &i : qAsConst(icons))
+        outputs.insert(QFileInfo(i).completeBaseName() + ".dci");
+    for (auto i = context.manifest.icons.constBegin(); i != context.manifest.icons.constEnd(); ++i) {
+        if (outputs.contains(i.value().toObject().value("duplicate_of").toString()))
+            icons.insert(i.key());
     }
 
-    for (const auto &i : dciFile.list("/")) {
-        if (dciFile.type(i) != DDciFile::Directory)
+    QElapsedTimer timer;
+    timer.start();
+    QVector<IconTask> tasks;
+    QSet<QString> dciFiles;
+    QSet<QString> removedFiles;
+    for (const auto &i : qAsConst(icons)) {
+        const QFileInfo file(i);
+        const QString dciFilePath(context.outputDir.absoluteFilePath(file.completeBaseName()) + ".dci");
+        if (dciFiles.contains(dciFilePath))
             continue;
+        dciFiles.insert(dciFilePath);
 
-        for (const auto &j : dciFile.list(i)) {
-            if (dciFile.type(j) != DDciFile::Directory || !j.endsWith(".light"))
-                continue;
+        const QString owner = context.outputSources.value(dciFilePath);
+        QStringList alternates;
+        QString source;
+        if (context.options.merge) {
+            // All of the sources of the name are merged to the first one
+            alternates = iconSourcesOfName(context.sourceDirectories, stamps, file.completeBaseName());
+            if (!alternates.isEmpty())
+                source = alternates.takeFirst();
+        } else if (owner.isEmpty() || owner == i || !stamps.contains(owner)) {
+            source = stamps.contains(i) ? i : QString();
+        } else {
+            continue;
+        }
 
-            const QString darkDir(j.left(j.size() - 5) + "dark");
-            Q_ASSERT(darkDir.endsWith(".dark"));
-            if (!dciFile.exists(darkDir)) {
-                dciChecker(dciFile.mkdir(darkDir));
-                dciChecker(recursionLink(dciFile, j, darkDir));
+        if (owner != source)
+            context.manifest.icons.remove(owner);
+        if (source.isEmpty()) {
+            if (!owner.isEmpty() && (context.options.merge || owner == i)) {
+                context.outputSources.remove(dciFilePath);
+                removedFiles.insert(QFileInfo(dciFilePath).fileName());
             }
+            continue;
+        }
+
+        context.outputSources.insert(dciFilePath, source);
+        IconTask task { QFileInfo(source), dciFilePath };
+        task.alternates = alternates;
+        task.manifestEntry = iconManifestEntry(task.file, dciFilePath, context.manifest.icons.value(source).toObject(),
+                                               alternates);
+        tasks.append(task);
+    }
+    removeStaleOutputs(context.outputDir, removedFiles);
+
+    convertIcons(tasks, context.options, context.jobs);
+    LinkBatch linkBatch;
+    int written = 0;
+    for (const auto &task : qAsConst(tasks)) {
+        if (!task.written) {
+            qWarning() << "Failed on rebuild the icon:" << task.file.filePath() << task.error;
+            continue;
+        }
+
+        ++written;
+        context.manifest.icons.insert(task.file.absoluteFilePath(), task.manifestEntry);
+        if (task.duplicateOf) {
+            linkBatch.addDuplicate(task.dciFilePath, task.duplicateOf->dciFilePath);
+            linkBatch.add(task.file, task.duplicateOf->dciFilePath, context.symlinksMap);
+        } else {
+            linkBatch.add(task.file, task.dciFilePath, context.symlinksMap);
         }
     }
+    createLinks(context.outputDir, linkBatch, context.jobs);
+
+    if (!saveManifest(context.outputDir, context.manifest))
+        qWarning() << "Failed on write the manifest file:" << context.outputDir.absoluteFilePath(manifestFileName);
+    qInfo().noquote() << QString("Rebuilt %1 icons and removed %2 icons in %3 ms")
+                         .arg(written).arg(removedFiles.size()).arg(timer.elapsed());
+}
+
+// Watch the source directories and their files, and rebuild the changed icons
+// in the end of a burst of changes, until the process is killed.
+static int watchSources(WatchContext &context)
+{
+    QStringList directories;
+    SourceStamps stamps = scanSourceStamps(context.sourceDirectories, context.nameFilters, directories);
+
+    QFileSystemWatcher watcher;
+    // The replaced files (e.g. saved by a rename) are removed from the watcher, so add them again
+    auto watchPaths = [&watcher](const QStringList &paths) {
+        QSet<QString> watched;
+        for (const auto &i : watcher.files() + watcher.directories())
+            watched.insert(i);
+
+        QStringList newPaths;
+        for (const auto &i : paths) {
+            if (!watched.contains(i))
+                newPaths << i;
+        }
+        if (!newPaths.isEmpty() && !watcher.addPaths(newPaths).isEmpty())
+            qWarning() << "Failed on watch some of the source files, check the limit of the inotify watches";
+    };
+    watchPaths(directories + stamps.keys());
+
+    // An editor may write a file many times while saving it, wait for the end of the changes
+    QTimer debounce;
+    debounce.setSingleShot(true);
+    debounce.setInterval(300);
+    QObject::connect(&watcher, &QFileSystemWatcher::directoryChanged, &debounce, [&debounce] {
+        debounce.start();
+    });
+    QObject::connect(&watcher, &QFileSystemWatcher::fileChanged, &debounce, [&debounce] {
+        debounce.start();
+    });
+    QObject::connect(&debounce, &QTimer::timeout, [&] {
+        QStringList newDirectories;
+        const SourceStamps newStamps = scanSourceStamps(context.sourceDirectories, context.nameFilters, newDirectories);
+        QSet<QString> changedFiles;
+        for (auto i = newStamps.constBegin(); i != newStamps.constEnd(); ++i) {
+            const auto old = stamps.constFind(i.key());
+            if (old == stamps.constEnd() || *old != i.value())
+                changedFiles.insert(i.key());
+        }
+        for (auto i = stamps.constBegin(); i != stamps.constEnd(); ++i) {
+            if (!newStamps.contains(i.key()))
+                changedFiles.insert(i.key());
+        }
+
+        stamps = newStamps;
+        watchPaths(newDirectories + stamps.keys());
+        if (!changedFiles.isEmpty())
+            rebuildIcons(context, changedFiles, stamps);
+    });
+
+    qInfo() << "Watching" << stamps.size() << "source files in" << directories.size() << "directories";
+    return QCoreApplication::exec();
+}
+
+static QCoreApplication *createApplication(int &argc, char **argv, bool gui)
+{
+    QCoreApplication *app = gui ? new QGuiApplication(argc, argv) : new QCoreApplication(argc, argv);
+    app->setApplicationName("dci-icon-theme");
+    app->setApplicationVersion("0.0.2");
+    return app;
+}
+
+static bool hasSvgSource(const SourceFiles &sourceFiles)
+{
+    for (const auto &i : sourceFiles.files) {
+        if (isSvgFile(i))
+            return true;
+    }
+
+    return false;
+}
+
+// Remove the arguments of QGuiApplication (e.g. -platform offscreen) to parse the other arguments
+// before the application is constructed, "found" is set if any of them are given.
+static QStringList removeGuiArguments(const QStringList &arguments, bool *found)
+{
+    static const QStringList valueOptions { "platform", "platformpluginpath", "platformtheme", "plugin",
+                                            "qwindowgeometry", "qwindowicon", "qwindowtitle", "session",
+                                            "display", "geometry" };
+    static const QStringList flagOptions { "reverse", "nograb", "dograb" };
+
+    *found = false;
+    QStringList result;
+    for (int i = 0; i < arguments.size(); ++i) {
+        const QString &argument = arguments.at(i);
+        if (argument == "--") {
+            result << arguments.mid(i);
+            break;
+        }
 
-    dciChecker(dciFile.writeToFile(newFile));
+        const QString name = argument.mid(argument.startsWith("--") ? 2 : 1);
+        if (i > 0 && argument.startsWith('-') && (valueOptions.contains(name) || flagOptions.contains(name))) {
+            *found = true;
+            if (valueOptions.contains(name))
+                ++i;
+            continue;
+        }
+        result << argument;
+    }
 
-    makeLink(file, outputDir, newFile, symlinksMap);
+    return result;
 }
 
 int main(int argc, char *argv[])
@@ -193,10 +3414,73 @@ int main(int argc, char *argv[])
                                   ,
                                        "csv file");
     QCommandLineOption fixDarkTheme("fix-dark-theme", "Create symlinks from light theme for dark theme files.");
+    QCommandLineOption jobs({"j", "jobs"}, "Convert the icons by the given number of worker threads, "
+                                           "0 means to use all of the CPU cores.", "N", "1");
+    QCommandLineOption maxMemory("max-memory", "Limit the estimated memory (MiB) of the icons in the conversion, "
+                                               "the next icon waits until the memory of the written icons is "
+                                               "released, an icon larger than the limit is converted alone, "
+                                               "0 means no limit.", "MiB", "0");
+    QCommandLineOption incremental("incremental", "Allow the output directory exists, only rebuild the dci files "
+                                                  "of the changed icons and remove the outputs of the deleted "
+                                                  "icons, by the state that every build saves to the \""
+                                                  + manifestFileName + "\" file of the output directory, so "
+                                                  "a failed or interrupted build is resumed by an incremental "
+                                                  "build.");
+    QCommandLineOption webpQuality("webp-quality", "The quality of the lossy webp encoding, from 0 to 100, "
+                                                   "100 means lossless.", "quality", "100");
+    QCommandLineOption webpLossless("webp-lossless", "Use the lossless webp encoding, the --webp-quality means "
+                                                     "the compression effort in this mode.");
+    QCommandLineOption autoEncode("auto-encode", "Choose the lossless, near-lossless or lossy webp encoding of "
+                                                 "every icon by the colors, edges and translucent pixels of the "
+                                                 "image, the chosen presets are in the report of --stats.");
+    QCommandLineOption webpMethod("webp-method", "The webp encoder method, from 0 (fastest) to 6 "
+                                                 "(slowest, the smallest files).", "method", "4");
+    QCommandLineOption iconSizes("sizes", "Give a comma separated list of the icon sizes to package "
+                                          "into each dci file.", "sizes", "256");
+    QCommandLineOption iconScales("scales", "Give a comma separated list of the scale factors to package "
+                                            "for each icon size.", "scales", "2,3");
 
-    QGuiApplication a(argc, argv);
-    a.setApplicationName("dci-icon-theme");
-    a.setApplicationVersion("0.0.2");
+    QCommandLineOption dedup("dedup", "Make the icon a symlink to the first icon that has the same light and "
+                                      "dark source files, and link the dark icon to the light icon in the dci "
+                                      "file if they are same.");
+    QCommandLineOption cacheDir("cache-dir", "Save the encoded images to the given directory, and reuse them "
+                                             "in the next builds, the directory can be shared by many builds.",
+                                "path");
+    QCommandLineOption cacheSize("cache-size", "The max size (MiB) of the --cache-dir, the least recently used "
+                                               "files are removed in the end of a build, 0 means no limit.",
+                                 "MiB", "2048");
+    QCommandLineOption merge("merge", "Merge the icons of the same name in all of the source directories (e.g. the "
+                                      "NxN directories of hicolor) into one dci file, every pixel size is encoded "
+                                      "from the source of the same size, or else the SVG source, or else the "
+                                      "nearest larger source.");
+    QCommandLineOption streamWriter("stream-writer", "Write the dci files to the disk while packaging them, "
+                                                     "instead of building the whole dci file and its copy in "
+                                                     "memory, the encoded images of an icon are still held in "
+                                                     "memory until it's written, so the memory of an icon "
+                                                     "still grows with the --sizes and --scales.");
+    QCommandLineOption packOutput("pack", "Also pack all of the output dci files and the symlinks into the given "
+                                        "file, with a sorted index of the icon names for mmap.", "file");
+    QCommandLineOption unpackInput("unpack", "Expand the given --pack file to the dci files and symlinks "
+                                            "of the -o directory.", "file");
+    QCommandLineOption lookupIndex("index", "Also write a hash table of the icon names and aliases to the resolved "
+                                            "dci files and their size/scale/mode entries, to the \""
+                                            + lookupIndexFileName + "\" file of the output directory.");
+    QCommandLineOption keepGoingOption("keep-going", "Don't stop on the icon that failed to convert, report the "
+                                                     "failed icons in the end and exit with an error, the next "
+                                                     "--incremental build only converts the failed icons.");
+    QCommandLineOption dryRun("dry-run", "Only print the number of the icons to convert, skip and link, and the "
+                                         "estimated size of the outputs, the images are not decoded.");
+    QCommandLineOption watch("watch", "Keep running after the build, and rebuild the dci files and the symlinks "
+                                      "of the changed, added and removed source files, the output directory "
+                                      "is updated like --incremental.");
+    QCommandLineOption verify("verify", "Check the layout of the dci files of the given directory, the links in "
+                                        "them and the symlinks to them, the images are not decoded.", "directory");
+    QCommandLineOption verifyWebp("verify-webp", "Also check the headers of the webp images of --verify.");
+    QCommandLineOption stats("stats", "Print the time of the stages, the throughput and the slowest icons.");
+    QCommandLineOption statsJson("stats-json", "Save the report of --stats to the given json file.", "file");
+    QCommandLineOption benchmark("benchmark", "Measure the conversion stages on a synthetic corpus of the given "
+                                              "number of icons, the --sizes, --scales and --webp-* options "
+                                              "are also used in this mode.", "count");
 
     QCommandLineParser cp;
     cp.setApplicationDescription("dci-icon-theme tool is a command tool that generate dci icons from common icons.\n"
@@ -207,18 +3491,107 @@ int main(int argc, char *argv[])
                                  "\t dci-icon-theme <input file directory> -o  <output directory path> -s ~/Desktop/symlink.csv \n"""
                                  );
 
-    cp.addOptions({fileFilter, outputDirectory, symlinkMap, fixDarkTheme});
+    cp.addOptions({fileFilter, outputDirectory, symlinkMap, fixDarkTheme, jobs, maxMemory,
+                   incremental, iconSizes, iconScales, webpQuality, webpLossless, webpMethod, autoEncode,
+                   dedup, merge, cacheDir, cacheSize, streamWriter, packOutput, unpackInput,
+                   lookupIndex, keepGoingOption, dryRun, watch, verify, verifyWebp,
+                   stats, statsJson, benchmark});
     cp.addPositionalArgument("source", "Search the given directory and it's subdirectories, "
                                        "get the files conform to rules of --match.",
                              "~/dci-png-icons");
     cp.addHelpOption();
     cp.addVersionOption();
-    cp.process(a);
 
-    if (a.arguments().size() == 1)
+    // Only the fonts of the texts in the SVG icons need the platform plugin of the GUI application,
+    // so decide it before constructing the application, the source directories are walked here for
+    // the build. The watch mode may get the new SVG sources later, and the Qt platform arguments
+    // are only known by the GUI application.
+    QStringList arguments;
+    for (int i = 0; i < argc; ++i)
+        arguments << QString::fromLocal8Bit(argv[i]);
+    bool guiArguments = false;
+    const bool parsed = cp.parse(removeGuiArguments(arguments, &guiArguments));
+
+    QVector<QRegExp> nameFilters;
+    for (const auto &i : cp.values(fileFilter))
+        nameFilters << QRegExp(i, Qt::CaseInsensitive, QRegExp::Wildcard);
+    const auto sourceDirectory = cp.positionalArguments();
+    QVector<SourceFiles> sourceScans(sourceDirectory.size());
+    QElapsedTimer timer;
+    qint64 traversalTime = 0;
+    bool svgSource = false;
+    if (parsed && !cp.isSet("help") && !cp.isSet("version")) {
+        for (int i = 0; i < sourceDirectory.size(); ++i) {
+            const QDir sourceDir(sourceDirectory.at(i));
+            if (!sourceDir.exists())
+                continue;
+
+            timer.start();
+            scanSourceDirectory(QFile::encodeName(sourceDir.absolutePath()), nameFilters, sourceScans[i]);
+            traversalTime += timer.nsecsElapsed();
+            svgSource = svgSource || hasSvgSource(sourceScans.at(i));
+        }
+    }
+
+    QScopedPointer<QCoreApplication> app(createApplication(argc, argv, guiArguments || cp.isSet(watch) || svgSource));
+    cp.process(*app);
+
+    if (app->arguments().size() == 1)
         cp.showHelp(-1);
 
-    if (cp.positionalArguments().isEmpty()) {
+    bool jobsOk = false;
+    int jobCount = cp.value(jobs).toInt(&jobsOk);
+    if (!jobsOk || jobCount < 0) {
+        qWarning() << "Invalid -j argument:" << cp.value(jobs);
+        cp.showHelp(-8);
+    }
+    if (jobCount == 0)
+        jobCount = QThread::idealThreadCount();
+    QThreadPool::globalInstance()->setMaxThreadCount(jobCount);
+
+    ConvertOptions convertOptions;
+    bool sizesOk = false, scalesOk = false;
+    convertOptions.sizes = parseNumberList(cp.value(iconSizes), &sizesOk);
+    convertOptions.scales = parseNumberList(cp.value(iconScales), &scalesOk);
+    if (!sizesOk || !scalesOk) {
+        qWarning() << "Invalid --sizes or --scales argument";
+        cp.showHelp(-8);
+    }
+
+    bool qualityOk = false, methodOk = false;
+    convertOptions.webp.quality = cp.value(webpQuality).toInt(&qualityOk);
+    convertOptions.webp.method = cp.value(webpMethod).toInt(&methodOk);
+    convertOptions.webp.lossless = cp.isSet(webpLossless);
+    convertOptions.dedup = cp.isSet(dedup);
+    convertOptions.streamWriter = cp.isSet(streamWriter);
+    convertOptions.merge = cp.isSet(merge);
+    convertOptions.autoEncode = cp.isSet(autoEncode);
+    bool maxMemoryOk = false;
+    convertOptions.maxMemory = cp.value(maxMemory).toLongLong(&maxMemoryOk) * 1024 * 1024;
+    if (!maxMemoryOk || convertOptions.maxMemory < 0) {
+        qWarning() << "Invalid --max-memory argument:" << cp.value(maxMemory);
+        cp.showHelp(-8);
+    }
+    if (!qualityOk || convertOptions.webp.quality < 0 || convertOptions.webp.quality > 100
+            || !methodOk || convertOptions.webp.method < 0 || convertOptions.webp.method > 6) {
+        qWarning() << "Invalid --webp-quality or --webp-method argument";
+        cp.showHelp(-8);
+    }
+
+    if (cp.isSet(benchmark)) {
+        bool countOk = false;
+        const int count = cp.value(benchmark).toInt(&countOk);
+        if (!countOk || count <= 0) {
+            qWarning() << "Invalid --benchmark argument:" << cp.value(benchmark);
+            cp.showHelp(-8);
+        }
+        return runBenchmark(convertOptions, count, jobCount);
+    }
+
+    if (cp.isSet(verify))
+        return verifyOutputDirectory(cp.value(verify), cp.isSet(verifyWebp), jobCount) ? 0 : -12;
+
+    if (cp.positionalArguments().isEmpty() && !cp.isSet(unpackInput)) {
         qWarning() << "Not give a source directory.";
         cp.showHelp(-2);
     }
@@ -228,99 +3601,270 @@ int main(int argc, char *argv[])
         cp.showHelp(-4);
     }
 
+
+    QScopedPointer<EncodeCache> encodeCache;
+    if (cp.isSet(cacheDir)) {
+        bool sizeOk = false;
+        const qint64 maxSize = cp.value(cacheSize).toLongLong(&sizeOk);
+        if (!sizeOk || maxSize < 0) {
+            qWarning() << "Invalid --cache-size argument:" << cp.value(cacheSize);
+            cp.showHelp(-8);
+        }
+        if (!QDir().mkpath(cp.value(cacheDir))) {
+            qWarning() << "Can't create the" << cp.value(cacheDir) << "directory";
+            cp.showHelp(-5);
+        }
+        encodeCache.reset(new EncodeCache(QDir(cp.value(cacheDir)).absolutePath(), maxSize * 1024 * 1024));
+        convertOptions.cache = encodeCache.data();
+    }
+
+    if (cp.isSet(watch) && (cp.isSet(fixDarkTheme) || cp.isSet(dryRun))) {
+        qWarning() << "The --watch can't be used with --fix-dark-theme or --dry-run";
+        cp.showHelp(-8);
+    }
+
+    const bool incrementalMode = (cp.isSet(incremental) || cp.isSet(watch)) && !cp.isSet(fixDarkTheme);
+    // Every build saves the manifest, so the next incremental build resumes a failed or interrupted build
+    const bool manifestMode = !cp.isSet(fixDarkTheme);
     QDir outputDir(cp.value(outputDirectory));
     if (!outputDir.exists()) {
-        if (!QDir::current().mkpath(outputDir.absolutePath())) {
+        // The dry run doesn't write anything
+        if (!cp.isSet(dryRun) && !QDir::current().mkpath(outputDir.absolutePath())) {
             qWarning() << "Can't create the" << outputDir.absolutePath() << "directory";
             cp.showHelp(-5);
         }
-    } else {
+    } else if (!incrementalMode) {
         qErrnoWarning("The output directory have been exists.");
         return -1;
     }
 
-    QMultiHash<QString, QString> symlinksMap;
+    if (cp.isSet(unpackInput))
+        return unpackFile(cp.value(unpackInput), outputDir) ? 0 : -10;
+
+    keepGoing = cp.isSet(keepGoingOption);
+    QStringList failures;
+    SymlinkMap symlinksMap;
     if (cp.isSet(symlinkMap)) {
-        symlinksMap = parseIconFileSymlinkMap(cp.value(symlinkMap));
+        bool symlinkMapOk = false;
+        symlinksMap = parseIconFileSymlinkMap(cp.value(symlinkMap), &symlinkMapOk);
+        if (!symlinkMapOk) {
+            if (!keepGoing)
+                return -7;
+            failures << QString("%1: Can't read the symlink map file").arg(cp.value(symlinkMap));
+        }
     }
 
-    const QStringList nameFilter = cp.isSet(fileFilter) ? cp.values(fileFilter) : QStringList();
-    const auto sourceDirectory = cp.positionalArguments();
-    for (const auto &sd : qAsConst(sourceDirectory)) {
-        QDir sourceDir(sd);
+    QVector<IconTask> tasks;
+    QVector<IconTask> fixTasks;
+    QSet<QString> claimedFiles;
+    LinkBatch linkBatch;
+    SkippedFiles skippedFiles;
+    QHash<QString, int> taskIndexes; // the dci file -> the index of the task
+
+    IconManifest oldManifest, newManifest;
+    if (incrementalMode)
+        oldManifest = loadManifest(outputDir);
+    newManifest.settings = convertOptions.settingsKey();
+    const bool settingsChanged = oldManifest.settings != newManifest.settings;
+    for (int d = 0; d < sourceDirectory.size(); ++d) {
+        QDir sourceDir(sourceDirectory.at(d));
         if (!sourceDir.exists()) {
             qWarning() << "Ignore the non-exists directory:" << sourceDir;
             continue;
         }
 
+        const SourceFiles &sourceFiles = sourceScans.at(d);
+
         // read all links first
-        {
-            QDirIterator di(sourceDir.absolutePath(), nameFilter,
-                            QDir::NoDotAndDotDot | QDir::Files,
-                            QDirIterator::Subdirectories);
-            while (di.hasNext()) {
-                di.next();
-                QFileInfo file = di.fileInfo();
-                 if (!file.isSymLink())
-                     continue;
-
-                 const QString &linkTarget = QFileInfo(file.readLink()).completeBaseName();
-                 if (!symlinksMap.values(linkTarget).contains(file.completeBaseName())) {
-                     symlinksMap.insert(linkTarget, file.completeBaseName());
-                     qInfo() << "add link" << file.completeBaseName() << "->" << linkTarget;
-                 } else {
-//                        qDebug() << "** link already existed in symlinksMap **";
-                 }
-            }
-        }
-
-        QDirIterator di(sourceDir.absolutePath(), nameFilter,
-                        QDir::NoDotAndDotDot | QDir::Files,
-                        QDirIterator::Subdirectories);
-        while (di.hasNext()) {
-            di.next();
-            QFileInfo file = di.fileInfo();
+        skippedFiles.sourceSymlinks += sourceFiles.symlinks.size();
+        for (const auto &i : qAsConst(sourceFiles.symlinks)) {
+            const QFileInfo file(i);
+            const QString &linkTarget = QFileInfo(file.readLink()).completeBaseName();
+            if (symlinksMap.insert(linkTarget, file.completeBaseName())) {
+                qInfo() << "add link" << file.completeBaseName() << "->" << linkTarget;
+            }
+        }
 
-            if (file.isSymLink())
-                continue;
+        for (const auto &i : qAsConst(sourceFiles.files)) {
+            const QFileInfo file(i);
 
             if (cp.isSet(fixDarkTheme)) {
-                doFixDarkTheme(file, outputDir, symlinksMap);
+                fixTasks.append({file, outputDir.absoluteFilePath(file.fileName())});
                 continue;
             }
 
             if (file.path().endsWith(QStringLiteral("/dark"))) {
                 qInfo() << "Ignore the dark icon file:"  << file;
+                ++skippedFiles.darkFiles;
                 continue;
             }
 
             const QString dciFilePath(outputDir.absoluteFilePath(file.completeBaseName()) + ".dci");
-            if (QFile::exists(dciFilePath)) {
+            // The sources of the same name, e.g. in the NxN directories of hicolor, are merged to the first one
+            if (convertOptions.merge && taskIndexes.contains(dciFilePath)) {
+                tasks[taskIndexes.value(dciFilePath)].alternates << file.absoluteFilePath();
+                continue;
+            }
+
+            // Claim the output file before converting, the first source wins like the
+            // sequential mode, so the workers never race on the same dci file.
+            if (claimedFiles.contains(dciFilePath) || (!incrementalMode && QFile::exists(dciFilePath))) {
                 qWarning() << "Skip exists dci file:" << dciFilePath;
+                ++skippedFiles.existsFiles;
                 continue;
             }
-            DDciFile dciFile;
+            claimedFiles.insert(dciFilePath);
+
+            taskIndexes.insert(dciFilePath, tasks.size());
+            tasks.append({ file, dciFilePath });
+        }
+    }
 
-            qInfo() << "Wrting to dci file:" << dciFilePath;
+    // The alternates of --merge are known after all of the source directories
+    if (incrementalMode) {
+        for (auto &task : tasks) {
+            const QJsonObject oldEntry = oldManifest.icons.value(task.file.absoluteFilePath()).toObject();
+            task.manifestEntry = iconManifestEntry(task.file, task.dciFilePath, oldEntry, task.alternates);
+            task.upToDate = !settingsChanged && QFile::exists(task.dciFilePath)
+                    && isSameIconContent(task.manifestEntry, oldEntry);
+        }
+        checkDuplicateOutputs(tasks, oldManifest);
+    }
 
-            dciChecker(dciFile.mkdir("/256"));
-            dciChecker(dciFile.mkdir("/256/normal.light"));
-            if (!writeImage(dciFile, file.filePath(), "/256/normal.light"))
-                continue;
+    if (cp.isSet(dryRun)) {
+        printBuildPlan(tasks, fixTasks, skippedFiles, symlinksMap, convertOptions, jobCount);
+        return 0;
+    }
 
-            dciChecker(dciFile.mkdir("/256/normal.dark"));
-            QFileInfo darkIcon(file.dir().absoluteFilePath("dark/" + file.fileName()));
-            if (darkIcon.exists()) {
-                writeImage(dciFile, darkIcon.filePath(), "/256/normal.dark");
-            } else {
-                dciChecker(recursionLink(dciFile, "/256/normal.light", "/256/normal.dark"));
+    // The journal of this build replaces the journal of an interrupted build, so merge it at first
+    QScopedPointer<ManifestJournal> journal;
+    if (manifestMode) {
+        if (!incrementalMode) {
+            for (auto &task : tasks)
+                task.manifestEntry = iconManifestEntry(task.file, task.dciFilePath, QJsonObject(), task.alternates);
+        }
+
+        const QString journalFile = outputDir.absoluteFilePath(manifestJournalFileName);
+        if (QFile::exists(journalFile) && !saveManifest(outputDir, oldManifest)) {
+            qWarning() << "Failed on write the manifest file:" << outputDir.absoluteFilePath(manifestFileName);
+            return -9;
+        }
+        journal.reset(new ManifestJournal(journalFile));
+        if (journal->open(newManifest.settings))
+            convertOptions.journal = journal.data();
+        else
+            qWarning() << "Failed on write the manifest journal:" << journalFile;
+    }
+
+    auto fixTask = [](IconTask &task) {
+        if (dciFatal.loadAcquire())
+            return;
+        dciFailed = false;
+        task.written = doFixDarkTheme(task.file, task.dciFilePath) && !dciFailed;
+        if (dciFailed) {
+            QFile::remove(temporaryFilePath(task.dciFilePath));
+            task.error = "Failed on writing the dci file";
+        } else if (!task.written) {
+            task.error = "Invalid dci file";
+        }
+    };
+    if (jobCount > 1) {
+        beginWorkers();
+        QtConcurrent::blockingMap(fixTasks, fixTask);
+        endWorkers();
+    } else {
+        for (auto &task : fixTasks)
+            fixTask(task);
+    }
+    for (const auto &task : qAsConst(fixTasks)) {
+        if (task.written)
+            linkBatch.add(task.file, task.dciFilePath, symlinksMap);
+    }
+
+    convertIcons(tasks, convertOptions, jobCount);
+    if (encodeCache) {
+        qInfo() << "Encode cache hits:" << encodeCache->hits() << "misses:" << encodeCache->misses();
+        encodeCache->trim();
+    }
+
+    if (manifestMode) {
+        for (const auto &task : qAsConst(tasks)) {
+            if (task.written)
+                newManifest.icons.insert(task.file.absoluteFilePath(), task.manifestEntry);
+        }
+    }
+
+    if (incrementalMode) {
+        QSet<QString> staleFiles;
+        for (auto i = oldManifest.icons.constBegin(); i != oldManifest.icons.constEnd(); ++i) {
+            const QString output = i.value().toObject().value("output").toString();
+            if (!newManifest.icons.contains(i.key()) && !output.isEmpty()
+                    && !claimedFiles.contains(outputDir.absoluteFilePath(output))) {
+                staleFiles.insert(output);
             }
+        }
+        removeStaleOutputs(outputDir, staleFiles);
+    }
+
+    // Collect the symlinks in the order of the source files, so the result is the
+    // same as the sequential mode when many icons want the same symlink.
+    for (const auto &task : qAsConst(tasks)) {
+        if (!task.written)
+            continue;
+
+        if (task.duplicateOf) {
+            linkBatch.addDuplicate(task.dciFilePath, task.duplicateOf->dciFilePath);
+            linkBatch.add(task.file, task.duplicateOf->dciFilePath, symlinksMap);
+        } else {
+            linkBatch.add(task.file, task.dciFilePath, symlinksMap);
+        }
+    }
+    timer.start();
+    createLinks(outputDir, linkBatch, jobCount);
+    const qint64 linkTime = timer.nsecsElapsed();
 
-            dciChecker(dciFile.writeToFile(dciFilePath));
+    if ((cp.isSet(stats) || cp.isSet(statsJson))
+            && !reportStats(tasks, traversalTime, linkTime, cp.isSet(stats), cp.value(statsJson))) {
+        qWarning() << "Failed on write the stats file:" << cp.value(statsJson);
+    }
 
-            makeLink(file, outputDir, dciFilePath, symlinksMap);
+    for (const auto *list : { &fixTasks, &tasks }) {
+        for (const auto &task : *list) {
+            if (!task.error.isEmpty())
+                failures << QString("%1: %2").arg(task.file.filePath(), task.error);
         }
     }
+    if (!failures.isEmpty())
+        qWarning().noquote() << "Failed icons:" << failures.size() << "\n\t" + failures.join("\n\t");
 
-    return 0;
+    if (journal)
+        journal->close();
+    if (manifestMode && !saveManifest(outputDir, newManifest)) {
+        qWarning() << "Failed on write the manifest file:" << outputDir.absoluteFilePath(manifestFileName);
+        return -9;
+    }
+
+    if (cp.isSet(lookupIndex) && !writeLookupIndex(outputDir)) {
+        qWarning() << "Failed on write the index file:" << outputDir.absoluteFilePath(lookupIndexFileName);
+        return -10;
+    }
+
+    if (cp.isSet(packOutput) && !writePackFile(outputDir, cp.value(packOutput))) {
+        qWarning() << "Failed on write the pack file:" << cp.value(packOutput);
+        return -10;
+    }
+
+    if (cp.isSet(watch)) {
+        WatchContext context { sourceDirectory, nameFilters, outputDir, convertOptions, jobCount, symlinksMap };
+        for (const auto &task : qAsConst(tasks))
+            context.outputSources.insert(task.dciFilePath, task.file.absoluteFilePath());
+        context.manifest = newManifest;
+        context.options.journal = nullptr;
+
+        // A failed icon is reported and rebuilt at the next change
+        keepGoing = true;
+        return watchSources(context);
+    }
+
+    return keepGoing && !failures.isEmpty() ? -11 : 0;
 }